@@ -5,7 +5,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_NUM_TASKS 6
 #define MAIN_TASK_ID 0
 
 #define TASK_STACK_SIZE 1024
@@ -19,42 +18,116 @@
 #define PSR_OFFSET 15
 #define PSR_DEFAULT 0x01000000
 
+// Cortex-M3 bit-band alias of a bit in the SRAM region, a store to it sets the bit atomically
+#define SRAM_BB_BASE 0x20000000
+#define SRAM_BB_END 0x20100000
+#define SRAM_BB_ALIAS 0x22000000
+#define BIT_BAND_ALIAS(addr, bit)                                                                                      \
+  ((volatile uint32_t *)(SRAM_BB_ALIAS + (((uint32_t)(addr)-SRAM_BB_BASE) << 5) + ((bit) << 2)))
+
+// Number of calls interrupts can defer before PendSV drains them, must be a power of two
+#define DEFERRED_QUEUE_SIZE 16
+// stored in place of a priority to mean the task's nominal priority at the time it is restored
+#define NOMINAL_PRIORITY ((taskPriority_t)(NO_PRIORITY + 1))
+
 uint8_t numTasks = 0;
 
 uint32_t RTOS_TICK_FREQ = 1000;
 uint32_t TIME_SLICE_TICKS = 5;
+uint32_t priorityTimeSlice[NUM_PRIORITIES];
 
 uint32_t rtosTickCounter;
 uint32_t nextTimeSlice;
 
 TCB_t TCBList[MAX_NUM_TASKS];
+rtosDeadlineMissFunc_t deadlineMissHook = NULL;
+TCB_t *timerServiceTCB = NULL;
+uint8_t timerServiceSleeping;
+rtosTimer_t *activeTimers = NULL;
 TCB_t *runningTCB;
 tcbQueue_t readyTaskPriorityQueue[NUM_PRIORITIES];
 tcbQueue_t waitingTaskPriorityQueue[NUM_PRIORITIES];
+// ready tasks whose partition is outside the current window
+tcbQueue_t parkedTaskPriorityQueue[NUM_PRIORITIES];
+
+uint32_t partitionWindows[MAX_PARTITIONS];
+uint8_t numPartitions;
+uint8_t currentPartition;
+uint32_t windowEnd;
+
+// cyclic executive mode, SysTick only keeps time once this is set
+uint8_t cyclicMode;
+uint8_t cyclicFrame;
+uint8_t cyclicFrameRunning;
+uint8_t cyclicFrameOverrun;
+uint32_t cyclicFrameEnd;
+uint32_t cyclicOverruns;
+rtosOverrunFunc_t overrunHook = NULL;
+
+// coroutines all run on one scheduler task
+TCB_t *coSchedulerTCB = NULL;
+uint8_t coSchedulerSleeping;
+coroutine_t *coReadyHead = NULL;
+coroutine_t *coReadyTail = NULL;
+coroutine_t *coSleeping = NULL;
 
 const int8_t NO_OWNER = -1;
 
 uint8_t inCriticalSection;
+uint8_t switchRequested;
+
+typedef struct {
+  rtosDeferredFunc_t func;
+  void *arg;
+} deferredCall_t;
+
+deferredCall_t deferredQueue[DEFERRED_QUEUE_SIZE];
+uint32_t deferredHead;
+uint32_t deferredTail;
 
 // This should only be called atomically
 void forceContextSwitch() {
-  rtosTickCounter = nextTimeSlice;
-  nextTimeSlice += TIME_SLICE_TICKS;
-
   // check if there is a ready task to switch to
   for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
     if (readyTaskPriorityQueue[priority].head != NULL) {
       // notify PendSV_Handler we are ready to switch
+      switchRequested = 1;
       SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
       break;
     }
   }
 }
 
+// Whether a should run before b in the EDF band. Tasks without a deadline only get here through
+// priority inheritance, and go first since an EDF task is waiting on them
+uint8_t deadlineBefore(TCB_t *a, TCB_t *b) {
+  if (a->relativeDeadline == 0 || b->relativeDeadline == 0) {
+    return a->relativeDeadline == 0 && b->relativeDeadline != 0;
+  }
+  return (int32_t)(a->absoluteDeadline - b->absoluteDeadline) < 0;
+}
+
 void addToList(TCB_t *toAdd, tcbQueue_t *queue) {
   if (queue[toAdd->taskPriority].head == NULL) { // empty priority list
     queue[toAdd->taskPriority].head = toAdd;
     queue[toAdd->taskPriority].tail = toAdd;
+  } else if (toAdd->taskPriority == EDF_PRIORITY) {
+    // EDF band is kept sorted by absolute deadline, fifo for equal deadlines
+    TCB_t *TCB_ptr = queue[toAdd->taskPriority].head;
+    TCB_t *TCB_prev_ptr = NULL;
+    while (TCB_ptr != NULL && !deadlineBefore(toAdd, TCB_ptr)) {
+      TCB_prev_ptr = TCB_ptr;
+      TCB_ptr = TCB_ptr->next;
+    }
+    toAdd->next = TCB_ptr;
+    if (TCB_prev_ptr == NULL) {
+      queue[toAdd->taskPriority].head = toAdd;
+    } else {
+      TCB_prev_ptr->next = toAdd;
+    }
+    if (TCB_ptr == NULL) {
+      queue[toAdd->taskPriority].tail = toAdd;
+    }
   } else {
     queue[toAdd->taskPriority].tail->next = toAdd;
     queue[toAdd->taskPriority].tail = toAdd;
@@ -62,93 +135,392 @@ void addToList(TCB_t *toAdd, tcbQueue_t *queue) {
   toAdd->currentQueue = queue;
 }
 
-void SysTick_Handler(void) {
-  // check if any waiting tasks are done
-
-  // iterate through all the task in order of priority and then in fifo
+TCB_t *popFromList(tcbQueue_t *queue) {
+  // pop the first task of the highest priority that has one
   for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-    if (waitingTaskPriorityQueue[priority].head != NULL) {
-      TCB_t *TCB_ptr = waitingTaskPriorityQueue[priority].head;
-      TCB_t *TCB_prev_ptr = NULL;
-      do {
-        // decrement time until wait ends
-        TCB_ptr->waitTicks--;
-
-        // if task is done waiting
-        if (TCB_ptr->waitTicks == 0) {
-          // set state to ready and add to ready queue
-          TCB_ptr->state = READY;
-          addToList(TCB_ptr, readyTaskPriorityQueue);
-
-          // remove task from waiting queue
-          if (TCB_ptr == waitingTaskPriorityQueue[priority].head) { // if task is the head
-            if (TCB_ptr->next == NULL) {                            // if its the only task in the queue
-              waitingTaskPriorityQueue[priority].tail = NULL;
-            }
-            waitingTaskPriorityQueue[priority].head = TCB_ptr->next;
-            TCB_ptr->next = NULL;
-            TCB_ptr = waitingTaskPriorityQueue[priority].head;
-          } else if (TCB_ptr == waitingTaskPriorityQueue[priority].tail) { // if task is that tail
-            TCB_prev_ptr->next = NULL;
-            waitingTaskPriorityQueue[priority].tail = TCB_prev_ptr;
-            TCB_ptr->next = NULL;
-            TCB_ptr = NULL;
-          } else { // neither head or tail
-            TCB_prev_ptr->next = TCB_ptr->next;
-            TCB_ptr->next = NULL;
-            TCB_ptr = TCB_prev_ptr->next;
-          }
-        } else {
-          TCB_prev_ptr = TCB_ptr;
-          TCB_ptr = TCB_ptr->next;
+    if (queue[priority].head != NULL) {
+      TCB_t *popped = queue[priority].head;
+
+      queue[priority].head = popped->next;
+      if (popped->next == NULL) { // if the only task in list
+        queue[priority].tail = NULL;
+      }
+      popped->next = NULL;
+      popped->currentQueue = NULL;
+      return popped;
+    }
+  }
+  return NULL;
+}
+
+uint8_t partitionActive(TCB_t *task) {
+  return numPartitions == 0 || task->partition == PARTITION_ALL || task->partition == currentPartition;
+}
+
+// This should only be called atomically
+void unblockTask(TCB_t *toUnblock) {
+  // set task to ready state and queue in ready task queue, or park it until its window comes around
+  toUnblock->state = READY;
+  addToList(toUnblock, partitionActive(toUnblock) ? readyTaskPriorityQueue : parkedTaskPriorityQueue);
+}
+
+// Unblock a task whose wait released a new job, sleeps and signals rather than lock hand-offs.
+// This should only be called atomically
+void releaseTask(TCB_t *task) {
+  if (task->relativeDeadline != 0 && task->periodic == NULL) {
+    // periodic tasks set their own deadlines, and an inherited deadline stays until the mutex is given back
+    if (task->inheritedDeadlines != 0) {
+      task->storedDeadline = rtosTickCounter + task->relativeDeadline;
+    } else {
+      task->absoluteDeadline = rtosTickCounter + task->relativeDeadline;
+    }
+  }
+  unblockTask(task);
+}
+
+// Remove the task after prev, or the head if prev is NULL, from a single priority list
+TCB_t *unlinkFromList(tcbQueue_t *list, TCB_t *prev) {
+  TCB_t *removed;
+  if (prev == NULL) {
+    removed = list->head;
+    list->head = removed->next;
+  } else {
+    removed = prev->next;
+    prev->next = removed->next;
+  }
+  if (list->tail == removed) {
+    list->tail = prev;
+  }
+  removed->next = NULL;
+  removed->currentQueue = NULL;
+  return removed;
+}
+
+// Remove a task from whichever queue it is in. This should only be called atomically
+void removeFromList(TCB_t *toRemove) {
+  tcbQueue_t *list = &(toRemove->currentQueue[toRemove->taskPriority]);
+
+  // find task in queue
+  TCB_t *TCB_ptr = list->head;
+  TCB_t *TCB_prev_ptr = NULL;
+  while (TCB_ptr != toRemove) {
+    TCB_prev_ptr = TCB_ptr;
+    TCB_ptr = TCB_ptr->next;
+  }
+  unlinkFromList(list, TCB_prev_ptr);
+}
+
+// Wake every task selecting on an object, they check for themselves if there is anything left for them
+// This should only be called atomically
+void wakeSelectWaiters(uint32_t *selectWaiters) {
+  for (uint8_t id = 0; *selectWaiters != 0; id++) {
+    if ((*selectWaiters & (1UL << id)) && TCBList[id].selectWaiting) {
+      TCBList[id].selectWaiting = 0;
+      if (TCBList[id].currentQueue != NULL) {
+        // timed select, take it off the wait queue early
+        removeFromList(&(TCBList[id]));
+      }
+      unblockTask(&(TCBList[id]));
+    }
+    *selectWaiters &= ~(1UL << id);
+  }
+}
+
+// Move a task to where its new deadline puts it in whichever queue it is in. This should only be called atomically
+void setTaskDeadline(TCB_t *task, uint32_t deadline) {
+  tcbQueue_t *queue = task->currentQueue;
+  if (queue != NULL) {
+    removeFromList(task);
+  }
+  task->absoluteDeadline = deadline;
+  if (queue != NULL) {
+    addToList(task, queue);
+  }
+}
+
+// This should only be called atomically
+void setTaskPriority(TCB_t *task, taskPriority_t priority) {
+  tcbQueue_t *queue = task->currentQueue;
+  if (queue == NULL) {
+    // running, or waiting on something without a queue, so there is nothing to move
+    task->taskPriority = priority;
+    return;
+  }
+
+  removeFromList(task);
+
+  // insert task back into same queue, but with its new priority
+  task->taskPriority = priority;
+  addToList(task, queue);
+}
+
+// The priority a task runs at without any inherited boost, a task demoted for running out of budget is capped at
+// LOWEST_PRIORITY
+taskPriority_t nominalPriority(TCB_t *task) {
+  if (task->budgetExhausted && task->budgetAction == BUDGET_DEMOTE) {
+    return LOWEST_PRIORITY;
+  }
+  return task->basePriority;
+}
+
+// What to store before boosting a task. An unboosted task stores NOMINAL_PRIORITY, so dropping the boost later
+// goes back to whatever its nominal priority is by then, even if its budget ran out or was refilled in between
+taskPriority_t priorityToRestore(TCB_t *task) {
+  return (task->taskPriority == nominalPriority(task)) ? NOMINAL_PRIORITY : task->taskPriority;
+}
+
+// This should only be called atomically
+void restorePriority(TCB_t *task, taskPriority_t stored) {
+  setTaskPriority(task, (stored == NOMINAL_PRIORITY) ? nominalPriority(task) : stored);
+}
+
+// Mark a task as in or out of budget, moving it to its new nominal priority unless a boost is keeping it higher.
+// This should only be called atomically
+void setBudgetExhausted(TCB_t *task, uint8_t exhausted) {
+  uint8_t boosted = task->taskPriority != nominalPriority(task);
+  task->budgetExhausted = exhausted;
+  if (!boosted) {
+    setTaskPriority(task, nominalPriority(task));
+  }
+}
+
+uint8_t higherPriorityReady(taskPriority_t taskPriority) {
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < taskPriority; priority++) {
+    if (readyTaskPriorityQueue[priority].head != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// ticks the task may run before round robin moves on to its peers, 0 if never
+uint32_t taskTimeSlice(TCB_t *task) {
+  if (task->timeSlice == TIME_SLICE_FROM_PRIORITY) {
+    return priorityTimeSlice[task->taskPriority];
+  }
+  return task->timeSlice;
+}
+
+// Whether a ready task should preempt task, either a higher priority or an earlier deadline in the EDF band
+uint8_t preemptionReady(TCB_t *task) {
+  if (higherPriorityReady(task->taskPriority)) {
+    return 1;
+  }
+  TCB_t *edfHead = readyTaskPriorityQueue[EDF_PRIORITY].head;
+  return task->taskPriority == EDF_PRIORITY && edfHead != NULL && deadlineBefore(edfHead, task);
+}
+
+// This should only be called atomically
+rtosStatus_t deferCall(rtosDeferredFunc_t func, void *arg) {
+  if (deferredHead - deferredTail == DEFERRED_QUEUE_SIZE) {
+    // PendSV has not caught up yet
+    return RTOS_ISR_QUEUE_FULL;
+  }
+  deferredQueue[deferredHead & (DEFERRED_QUEUE_SIZE - 1)].func = func;
+  deferredQueue[deferredHead & (DEFERRED_QUEUE_SIZE - 1)].arg = arg;
+  deferredHead++;
+
+  // PendSV runs the call once no other interrupt is active
+  SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+  return RTOS_OK;
+}
+
+// Only called from PendSV_Handler, before anything is stored. Keeping this out of the
+// handler itself means R4-R11 are still the task's when storeContext runs
+uint8_t contextSwitchNeeded(void) {
+  // run everything interrupts deferred, this may wake up tasks
+  __disable_irq();
+  while (deferredTail != deferredHead) {
+    deferredCall_t *call = &(deferredQueue[deferredTail & (DEFERRED_QUEUE_SIZE - 1)]);
+    call->func(call->arg);
+    deferredTail++;
+  }
+  __enable_irq();
+
+  if (cyclicMode) {
+    // the executive never gives up the cpu, deferred work is all that runs
+    switchRequested = 0;
+    return 0;
+  }
+  if (switchRequested || runningTCB->state != RUNNING) {
+    return 1;
+  }
+  // a wake up from an interrupt only preempts if it readied a higher priority task
+  return !inCriticalSection && preemptionReady(runningTCB);
+}
+
+// Charge the tick to the running job and flag jobs that reach their deadline unfinished, called from SysTick_Handler
+void checkPeriodicJobs(void) {
+  if (runningTCB->periodic != NULL && runningTCB->periodic->jobActive) {
+    runningTCB->periodic->jobTicks++;
+  }
+  for (uint8_t i = 0; i < numTasks; i++) {
+    rtosPeriodicTask_t *task = TCBList[i].periodic;
+    // the job's own deadline, the TCB one can be inherited through a mutex
+    if (task != NULL && task->jobActive && !task->jobMissed &&
+        (int32_t)(rtosTickCounter - (task->release + task->deadline)) >= 0) {
+      // only counted once per job, however late it ends up being
+      task->jobMissed = 1;
+      task->deadlineMisses++;
+      if (deadlineMissHook != NULL) {
+        deadlineMissHook(i);
+      }
+    }
+  }
+}
+
+// Refill budgets that are due and charge the tick to the running task, called from SysTick_Handler
+void checkBudgets(void) {
+  for (uint8_t i = 0; i < numTasks; i++) {
+    TCB_t *task = &(TCBList[i]);
+    if (task->budget != 0 && (int32_t)(rtosTickCounter - task->budgetRefill) >= 0) {
+      task->budgetRemaining = task->budget;
+      task->budgetRefill += task->budgetPeriod;
+      if (task->budgetExhausted) {
+        // let the task back in at its own priority
+        setBudgetExhausted(task, 0);
+        if (task->state == SUSPENDED) {
+          unblockTask(task);
         }
-      } while (TCB_ptr != NULL);
+      }
+    }
+  }
+
+  if (runningTCB->budget == 0 || runningTCB->budgetExhausted) {
+    return;
+  }
+  if (runningTCB->budgetRemaining != 0) {
+    runningTCB->budgetRemaining--;
+  }
+  // a task that runs out inside a critical section is stopped on the first tick after it
+  if (runningTCB->budgetRemaining == 0 && runningTCB->state == RUNNING && !inCriticalSection) {
+    // a demoted task can still use whatever time nothing else wants, but keeps any boost from a waiter
+    setBudgetExhausted(runningTCB, 1);
+    if (runningTCB->budgetAction == BUDGET_SUSPEND) {
+      // PendSV won't requeue it since it is no longer running
+      runningTCB->state = SUSPENDED;
+      switchRequested = 1;
+      SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+    }
+  }
+}
+
+// Move the tasks in from over to to, the ones now in their window if moveActive or else the ones now out of it
+void sortPartitionQueue(tcbQueue_t *from, tcbQueue_t *to, uint8_t moveActive) {
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    TCB_t *TCB_ptr = from[priority].head;
+    TCB_t *TCB_prev_ptr = NULL;
+    while (TCB_ptr != NULL) {
+      if (partitionActive(TCB_ptr) == moveActive) {
+        unlinkFromList(&(from[priority]), TCB_prev_ptr);
+        addToList(TCB_ptr, to);
+        TCB_ptr = (TCB_prev_ptr == NULL) ? from[priority].head : TCB_prev_ptr->next;
+      } else {
+        TCB_prev_ptr = TCB_ptr;
+        TCB_ptr = TCB_ptr->next;
+      }
+    }
+  }
+}
+
+// Move on to the next window of the major frame once this one is up, called from SysTick_Handler
+void checkPartitionWindow(void) {
+  if (numPartitions == 0 || (int32_t)(rtosTickCounter - windowEnd) < 0) {
+    return;
+  }
+  currentPartition = (currentPartition + 1) % numPartitions;
+  windowEnd += partitionWindows[currentPartition];
+  sortPartitionQueue(readyTaskPriorityQueue, parkedTaskPriorityQueue, 0);
+  sortPartitionQueue(parkedTaskPriorityQueue, readyTaskPriorityQueue, 1);
+}
+
+// Flag a minor frame whose jobs are still running when it ends, called from SysTick_Handler
+void checkCyclicFrame(void) {
+  if (cyclicFrameRunning && !cyclicFrameOverrun && (int32_t)(rtosTickCounter - cyclicFrameEnd) >= 0) {
+    cyclicFrameOverrun = 1;
+    cyclicOverruns++;
+    if (overrunHook != NULL) {
+      overrunHook(cyclicFrame);
     }
   }
+}
 
-  // check for timeslices
+void SysTick_Handler(void) {
   rtosTickCounter++;
-  if (rtosTickCounter - nextTimeSlice >= TIME_SLICE_TICKS && !inCriticalSection) {
-    // we are ready to switch to the next task
-    nextTimeSlice += TIME_SLICE_TICKS;
-    // check if there is a ready task to switch to
-    for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-      if (readyTaskPriorityQueue[priority].head != NULL) {
-        // notify PendSV_Handler we are ready to switch
-        SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
-        break;
+  if (cyclicMode) {
+    // nothing is scheduled in cyclic mode, the executive runs every job itself
+    checkCyclicFrame();
+    return;
+  }
+  checkPeriodicJobs();
+  checkBudgets();
+  checkPartitionWindow();
+
+  // check if any waiting tasks are done
+  // iterate through all the task in order of priority and then in fifo
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    TCB_t *TCB_ptr = waitingTaskPriorityQueue[priority].head;
+    TCB_t *TCB_prev_ptr = NULL;
+    while (TCB_ptr != NULL) {
+      // decrement time until wait ends
+      TCB_ptr->waitTicks--;
+
+      // if task is done waiting
+      if (TCB_ptr->waitTicks == 0) {
+        // remove task from waiting queue, and add to ready queue
+        unlinkFromList(&(waitingTaskPriorityQueue[priority]), TCB_prev_ptr);
+        releaseTask(TCB_ptr);
+        TCB_ptr = (TCB_prev_ptr == NULL) ? waitingTaskPriorityQueue[priority].head : TCB_prev_ptr->next;
+      } else {
+        TCB_prev_ptr = TCB_ptr;
+        TCB_ptr = TCB_ptr->next;
       }
     }
-  } else if (inCriticalSection) {
-    if (rtosTickCounter - nextTimeSlice >= TIME_SLICE_TICKS) {
-      nextTimeSlice++;
+  }
+
+  if (inCriticalSection) {
+    // a slice that ends in a critical section ends on the first tick after it
+    return;
+  }
+  if (preemptionReady(runningTCB) || !partitionActive(runningTCB)) {
+    // a task that just finished waiting outranks the running one, don't make it wait out the slice
+    switchRequested = 1;
+    SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+  } else if (taskTimeSlice(runningTCB) != 0 && (int32_t)(rtosTickCounter - nextTimeSlice) >= 0) {
+    // slice is up, so switch if another task of the same priority is ready, FIFO tasks never get here
+    nextTimeSlice = rtosTickCounter + taskTimeSlice(runningTCB);
+    if (readyTaskPriorityQueue[runningTCB->taskPriority].head != NULL) {
+      // notify PendSV_Handler we are ready to switch
+      switchRequested = 1;
+      SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
     }
   }
 }
 
 void PendSV_Handler(void) {
+  // PendSV may have only been pended to run deferred interrupt work
+  if (!contextSwitchNeeded()) {
+    return;
+  }
+  switchRequested = 0;
+
   // Preform context switch if we are ready to switch tasks
   // software store context of current running task
   runningTCB->stackPointer = storeContext();
 
   // queue the current running task
-  if (runningTCB->state != WAITING) {
-    addToList(runningTCB, readyTaskPriorityQueue);
-    runningTCB->state = RUNNING;
+  if (runningTCB->state == RUNNING) {
+    unblockTask(runningTCB);
   }
 
   // pop next task
-  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-    if (readyTaskPriorityQueue[priority].head != NULL) {
-      runningTCB = readyTaskPriorityQueue[priority].head;
-      readyTaskPriorityQueue[priority].head = runningTCB->next;
-      if (runningTCB->next == NULL) {
-        readyTaskPriorityQueue[priority].tail = NULL;
-      }
-      runningTCB->next = NULL;
-      break;
-    }
+  TCB_t *nextTCB = popFromList(readyTaskPriorityQueue);
+  if (nextTCB != NULL) {
+    runningTCB = nextTCB;
+    runningTCB->state = RUNNING;
   }
+  // next task gets a full time slice
+  nextTimeSlice = rtosTickCounter + taskTimeSlice(runningTCB);
 
   // software restore context of next task
   __set_PSP(runningTCB->stackPointer);
@@ -164,7 +536,18 @@ void rtosInit(void) {
     TCBList[i].next = NULL;
     TCBList[i].state = SUSPENDED;
     TCBList[i].waitTicks = 0;
-    TCBList[i].taskPriority = DEFAULT_PRIORITY;
+    TCBList[i].taskPriority = TCBList[i].basePriority = DEFAULT_PRIORITY;
+    TCBList[i].timeSlice = TIME_SLICE_FROM_PRIORITY;
+    TCBList[i].relativeDeadline = 0;
+    TCBList[i].absoluteDeadline = 0;
+    TCBList[i].periodic = NULL;
+    TCBList[i].inheritedDeadlines = 0;
+    TCBList[i].budget = 0;
+    TCBList[i].budgetExhausted = 0;
+    TCBList[i].partition = PARTITION_ALL;
+    TCBList[i].selectWaiting = 0;
+    TCBList[i].notifyValue = 0;
+    TCBList[i].notifyWaiting = 0;
   }
 
   // copy over main stack to first task's stack
@@ -174,7 +557,7 @@ void rtosInit(void) {
          (void *)((*((uint32_t *)SCB->VTOR)) - TASK_STACK_SIZE), TASK_STACK_SIZE);
 
   // set Main Task to lowest Priority to act as idle thread
-  TCBList[MAIN_TASK_ID].taskPriority = LOWEST_PRIORITY;
+  TCBList[MAIN_TASK_ID].taskPriority = TCBList[MAIN_TASK_ID].basePriority = LOWEST_PRIORITY;
 
   // change main stack pointer to be inside init
   TCBList[MAIN_TASK_ID].stackPointer = TCBList[MAIN_TASK_ID].baseOfStack - ((*((uint32_t *)SCB->VTOR)) - __get_MSP());
@@ -196,7 +579,19 @@ void rtosInit(void) {
     readyTaskPriorityQueue[priority].tail = NULL;
     waitingTaskPriorityQueue[priority].head = NULL;
     waitingTaskPriorityQueue[priority].tail = NULL;
+    parkedTaskPriorityQueue[priority].head = NULL;
+    parkedTaskPriorityQueue[priority].tail = NULL;
+    priorityTimeSlice[priority] = TIME_SLICE_TICKS;
   }
+  // EDF tasks run until they block or an earlier deadline is ready
+  priorityTimeSlice[EDF_PRIORITY] = 0;
+
+  cyclicMode = 0;
+  cyclicOverruns = 0;
+
+  // every task runs all the time until partitions are set up
+  numPartitions = 0;
+  currentPartition = 0;
 
   // set up timer variables
   rtosTickCounter = 0;
@@ -205,20 +600,24 @@ void rtosInit(void) {
   // initialize inCriticalSection
   inCriticalSection = 0;
 
+  // nothing deferred or requested yet
+  switchRequested = 0;
+  deferredHead = 0;
+  deferredTail = 0;
+
+  // PendSV must never preempt another interrupt, so it shares the lowest priority with SysTick
+  NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+
   // Set systick interrupt to fire at the time slice frequency
   SysTick_Config(SystemCoreClock / RTOS_TICK_FREQ);
 }
 
-rtosStatus_t rtosThreadNew(rtosTaskFunc_t func, void *arg, taskPriority_t taskPriority) {
-  rtosEnterFunction();
-  __disable_irq();
-  if (numTasks == 0) {
-    // rtos has not yet, return and notify somehow???
-    return RTOS_NOT_INIT;
-  }
+// Set up the next free TCB and queue it, returns NULL if there isn't one
+// This should only be called atomically
+TCB_t *createTask(rtosTaskFunc_t func, void *arg, taskPriority_t taskPriority, uint32_t relativeDeadline,
+                  rtosPeriodicTask_t *periodic) {
   if (numTasks == MAX_NUM_TASKS) {
-    // Max number of tasks reached, return and notify somehow???
-    return RTOS_MAX_TASKS;
+    return NULL;
   }
 
   // Get next task block
@@ -231,197 +630,1980 @@ rtosStatus_t rtosThreadNew(rtosTaskFunc_t func, void *arg, taskPriority_t taskPr
   // set PSR to default value (0x01000000)
   *((uint32_t *)newTCB->stackPointer + PSR_OFFSET) = PSR_DEFAULT;
 
+  // the deadline has to be set before the task is queued by it
+  newTCB->relativeDeadline = relativeDeadline;
+  newTCB->absoluteDeadline = rtosTickCounter + relativeDeadline;
+  newTCB->periodic = periodic;
+
   // set current task to ready and put it in the list
-  newTCB->taskPriority = taskPriority;
+  newTCB->taskPriority = newTCB->basePriority = taskPriority;
   newTCB->state = READY;
   addToList(newTCB, readyTaskPriorityQueue);
 
   // bump up num tasks
   numTasks++;
-  __enable_irq();
-  rtosExitFunction();
-  return RTOS_OK;
+  return newTCB;
 }
 
-rtosStatus_t rtosSemaphoreInit(semaphore_t *sem, uint8_t count) {
-  rtosEnterFunction();
-  sem->count = count;
-  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-    sem->waitingPriorityQueue[priority].head = NULL;
-    sem->waitingPriorityQueue[priority].tail = NULL;
+rtosStatus_t rtosThreadNew(rtosTaskFunc_t func, void *arg, taskPriority_t taskPriority) {
+  if (numTasks == 0) {
+    // rtos not initialized
+    return RTOS_NOT_INIT;
+  }
+  if (taskPriority >= NUM_PRIORITIES || taskPriority == EDF_PRIORITY) {
+    // the EDF band only holds tasks with a deadline, see rtosThreadNewEDF and rtosThreadNewPeriodic
+    return RTOS_INVALID_PRIORITY;
   }
+  rtosEnterFunction();
+  __disable_irq();
+  TCB_t *newTCB = createTask(func, arg, taskPriority, 0, NULL);
+  __enable_irq();
   rtosExitFunction();
+  if (newTCB == NULL) {
+    // Max number of tasks reached
+    return RTOS_MAX_TASKS;
+  }
   return RTOS_OK;
 }
 
-rtosStatus_t rtosWaitOnSemaphore(semaphore_t *sem) {
+rtosStatus_t rtosThreadNewEDF(rtosTaskFunc_t func, void *arg, uint32_t relativeDeadline) {
+  if (numTasks == 0) {
+    return RTOS_NOT_INIT;
+  }
+  if (relativeDeadline == 0) {
+    // a task with no deadline would sort ahead of every real EDF task
+    return RTOS_INVALID_DEADLINE;
+  }
   rtosEnterFunction();
   __disable_irq();
-  if (sem->count > 0) {
-    // semaphore is open
-    sem->count--;
-  } else {
-    // semaphore is closed, wait until it is signalled
-    runningTCB->state = WAITING;
-    addToList(runningTCB, sem->waitingPriorityQueue);
-    forceContextSwitch();
-  }
+  TCB_t *newTCB = createTask(func, arg, EDF_PRIORITY, relativeDeadline, NULL);
   __enable_irq();
   rtosExitFunction();
+  if (newTCB == NULL) {
+    return RTOS_MAX_TASKS;
+  }
   return RTOS_OK;
 }
 
-rtosStatus_t rtosSignalSemaphore(semaphore_t *sem) {
-  rtosEnterFunction();
+void startPeriodicJob(rtosPeriodicTask_t *task) {
   __disable_irq();
-  sem->count++;
+  task->jobTicks = 0;
+  task->jobMissed = 0;
+  task->jobActive = 1;
+  task->jobsReleased++;
+  __enable_irq();
+}
 
-  // check if there is a task waiting for semaphore
-  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-    if (sem->waitingPriorityQueue[priority].head != NULL) {
-      TCB_t *unblockedTask = sem->waitingPriorityQueue[priority].head;
+void finishPeriodicJob(rtosPeriodicTask_t *task) {
+  __disable_irq();
+  task->jobActive = 0;
+  task->jobsCompleted++;
+  if (task->jobTicks > task->maxJobTicks) {
+    task->maxJobTicks = task->jobTicks;
+  }
+  if (task->jobTicks > task->wcet) {
+    task->wcetOverruns++;
+  }
+  // deadline of the next job, set now so an EDF task waits in the right place
+  if (task->tcb->inheritedDeadlines != 0) {
+    task->tcb->storedDeadline = task->release + task->period + task->deadline;
+  } else {
+    task->tcb->absoluteDeadline = task->release + task->period + task->deadline;
+  }
+  __enable_irq();
+}
 
-      sem->waitingPriorityQueue[priority].head = unblockedTask->next;
-      if (unblockedTask->next == NULL) { // if the only task in list
-        sem->waitingPriorityQueue[priority].tail = NULL;
-      }
+void periodicTaskEntry(void *args) {
+  rtosPeriodicTask_t *task = (rtosPeriodicTask_t *)args;
+  while (1) {
+    startPeriodicJob(task);
+    task->job(task->arg);
+    finishPeriodicJob(task);
+    // a job that overran its period releases the next one straight away
+    rtosWaitPeriod(&(task->release), task->period);
+  }
+}
 
-      // set task to ready state and queue in ready task queue
-      unblockedTask->next = NULL;
-      unblockedTask->state = READY;
-      addToList(unblockedTask, readyTaskPriorityQueue);
-      break;
-    }
+rtosStatus_t rtosThreadNewPeriodic(rtosPeriodicTask_t *task, rtosTaskFunc_t job, void *arg, taskPriority_t priority,
+                                   uint32_t period, uint32_t deadline, uint32_t wcet) {
+  if (numTasks == 0) {
+    return RTOS_NOT_INIT;
   }
+  if (period == 0) {
+    // the task would never sleep between jobs and starve everything below it
+    return RTOS_INVALID_PERIOD;
+  }
+  if (deadline == 0) {
+    // every job would miss, and at EDF_PRIORITY it would sort ahead of every real deadline
+    return RTOS_INVALID_DEADLINE;
+  }
+  if (priority >= NUM_PRIORITIES) {
+    return RTOS_INVALID_PRIORITY;
+  }
+  task->job = job;
+  task->arg = arg;
+  task->period = period;
+  task->deadline = deadline;
+  task->wcet = wcet;
+  task->jobTicks = 0;
+  task->jobActive = 0;
+  task->jobMissed = 0;
+  task->jobsReleased = 0;
+  task->jobsCompleted = 0;
+  task->deadlineMisses = 0;
+  task->wcetOverruns = 0;
+  task->maxJobTicks = 0;
+
+  rtosEnterFunction();
+  __disable_irq();
+  // first job is released now, the task can't run before interrupts are back on so tcb is set in time
+  task->release = rtosTickCounter;
+  task->tcb = createTask(periodicTaskEntry, task, priority, deadline, task);
   __enable_irq();
   rtosExitFunction();
+  if (task->tcb == NULL) {
+    return RTOS_MAX_TASKS;
+  }
   return RTOS_OK;
 }
 
-rtosStatus_t rtosMutexInit(mutex_t *mutex) {
+rtosStatus_t rtosSetTaskBudget(uint8_t taskId, uint32_t budget, uint32_t period, rtosBudgetAction_t action) {
+  if (taskId >= numTasks) {
+    return RTOS_INVALID_TASK;
+  }
+  if (budget != 0 && (period == 0 || budget > period)) {
+    // it would refill every tick, or never run out
+    return RTOS_INVALID_PERIOD;
+  }
+  if (budget != 0 && action == BUDGET_SUSPEND && taskId == MAIN_TASK_ID) {
+    // the idle task has to stay ready for when nothing else is
+    return RTOS_INVALID_TASK;
+  }
   rtosEnterFunction();
-  mutex->owner = NO_OWNER;
-  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-    mutex->waitingPriorityQueue[priority].head = NULL;
-    mutex->waitingPriorityQueue[priority].tail = NULL;
-    mutex->storedPriority = NO_PRIORITY;
+  __disable_irq();
+  TCB_t *task = &(TCBList[taskId]);
+  if (task->budgetExhausted) {
+    // changing the budget lifts whatever the old one did to the task
+    setBudgetExhausted(task, 0);
+    if (task->state == SUSPENDED) {
+      unblockTask(task);
+    }
   }
+  task->budget = budget;
+  task->budgetPeriod = period;
+  task->budgetRemaining = budget;
+  task->budgetRefill = rtosTickCounter + period;
+  task->budgetAction = action;
+  forceContextSwitch();
+  __enable_irq();
   rtosExitFunction();
   return RTOS_OK;
 }
 
-rtosStatus_t rtosAcquireMutex(mutex_t *mutex) {
+rtosStatus_t rtosPartitionsInit(const uint32_t *windowTicks, uint8_t count) {
+  if (count > MAX_PARTITIONS) {
+    return RTOS_INVALID_PARTITION;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    if (windowTicks[i] == 0) {
+      // the partition would never run and the window switch would spin
+      return RTOS_INVALID_PARTITION;
+    }
+  }
   rtosEnterFunction();
   __disable_irq();
-  if (mutex->owner == NO_OWNER) {
-    mutex->owner = runningTCB->id;
-  } else { // mutex already owned
-
-    if (TCBList[mutex->owner].taskPriority > runningTCB->taskPriority) {
-      // elevate mutex owner priority to level of running TCB
-      mutex->storedPriority = TCBList[mutex->owner].taskPriority;
-      TCBList[mutex->owner].taskPriority = runningTCB->taskPriority;
-
-      tcbQueue_t *queue = TCBList[mutex->owner].currentQueue;
-      taskPriority_t priority = mutex->storedPriority;
-
-      TCB_t *TCB_ptr = queue[priority].head;
-      TCB_t *TCB_prev_ptr = NULL;
-      // find task in queue
-      while (TCB_ptr->id != mutex->owner) {
-        TCB_prev_ptr = TCB_ptr;
-        TCB_ptr = TCB_ptr->next;
-      }
-      // remove task from queue
-      if (TCB_ptr == queue[priority].head) { // if task is the head
-        if (TCB_ptr->next == NULL) {         // if its the only task in the queue
-          queue[priority].tail = NULL;
-        }
-        queue[priority].head = TCB_ptr->next;
-        TCB_ptr->next = NULL;
-        TCB_ptr = queue[priority].head;
-      } else if (TCB_ptr == queue[priority].tail) { // if task is that tail
-        TCB_prev_ptr->next = NULL;
-        queue[priority].tail = TCB_prev_ptr;
-        TCB_ptr->next = NULL;
-        TCB_ptr = NULL;
-      } else { // neither head or tail
-        TCB_prev_ptr->next = TCB_ptr->next;
-        TCB_ptr->next = NULL;
-        TCB_ptr = TCB_prev_ptr->next;
-      }
-      // insert elevated mutex owner task back into same queue,but with elevated priority
-      addToList(&(TCBList[mutex->owner]), queue);
-    }
-
-    runningTCB->state = WAITING;
-    addToList(runningTCB, mutex->waitingPriorityQueue);
-    forceContextSwitch();
+  for (uint8_t i = 0; i < count; i++) {
+    partitionWindows[i] = windowTicks[i];
   }
+  // the major frame starts now with the first partition's window
+  numPartitions = count;
+  currentPartition = 0;
+  windowEnd = rtosTickCounter + partitionWindows[0];
+  sortPartitionQueue(readyTaskPriorityQueue, parkedTaskPriorityQueue, 0);
+  sortPartitionQueue(parkedTaskPriorityQueue, readyTaskPriorityQueue, 1);
+  forceContextSwitch();
   __enable_irq();
   rtosExitFunction();
   return RTOS_OK;
 }
 
-rtosStatus_t rtosReleaseMutex(mutex_t *mutex) {
+rtosStatus_t rtosSetTaskPartition(uint8_t taskId, uint8_t partition) {
+  if (taskId >= numTasks || taskId == MAIN_TASK_ID) {
+    // the idle task stays in every window, so PendSV always has something to run
+    return RTOS_INVALID_TASK;
+  }
+  if (partition >= numPartitions && partition != PARTITION_ALL) {
+    return RTOS_INVALID_PARTITION;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  TCB_t *task = &(TCBList[taskId]);
+  task->partition = partition;
+  if (task->state == READY) {
+    // requeue, which parks it or lets it out depending on the current window
+    removeFromList(task);
+    unblockTask(task);
+  }
+  // the running task is parked by PendSV if it just left the current window
+  forceContextSwitch();
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSetOverrunHook(rtosOverrunFunc_t hook) {
+  __disable_irq();
+  overrunHook = hook;
+  __enable_irq();
+  return RTOS_OK;
+}
+
+uint32_t rtosGetCyclicOverruns(void) { return cyclicOverruns; }
+
+rtosStatus_t rtosCyclicExecutiveStart(const rtosCyclicJob_t *table, uint8_t numJobs, uint8_t numFrames,
+                                      uint32_t minorFrameTicks) {
+  if (numTasks == 0) {
+    // SysTick isn't running yet
+    return RTOS_NOT_INIT;
+  }
+  if (numFrames == 0 || numFrames > MAX_CYCLIC_FRAMES || minorFrameTicks == 0) {
+    return RTOS_INVALID_FRAME;
+  }
+  __disable_irq();
+  cyclicMode = 1;
+  cyclicFrame = 0;
+  cyclicFrameEnd = rtosTickCounter + minorFrameTicks;
+  __enable_irq();
+
+  // from here on everything runs to completion on this task's stack
+  while (1) {
+    cyclicFrameOverrun = 0;
+    cyclicFrameRunning = 1;
+    for (uint8_t i = 0; i < numJobs; i++) {
+      if (table[i].frames & (1UL << cyclicFrame)) {
+        table[i].job(table[i].arg);
+      }
+    }
+    cyclicFrameRunning = 0;
+
+    // sleep out the rest of the frame, frames that started late run back to back until they catch up.
+    // check with interrupts masked so a tick between the check and the WFI still wakes us
+    __disable_irq();
+    while ((int32_t)(*((volatile uint32_t *)&rtosTickCounter) - cyclicFrameEnd) < 0) {
+      __WFI();
+      // let the pending tick run before checking again
+      __enable_irq();
+      __disable_irq();
+    }
+    __enable_irq();
+    cyclicFrame = (cyclicFrame + 1) % numFrames;
+    cyclicFrameEnd += minorFrameTicks;
+  }
+}
+
+rtosStatus_t rtosSetDeadlineMissHook(rtosDeadlineMissFunc_t hook) {
+  rtosEnterFunction();
+  __disable_irq();
+  deadlineMissHook = hook;
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void wakeCoroutineScheduler(void) {
+  // only wake it from its own sleep, a coroutine may be keeping it busy
+  if (coSchedulerSleeping && coSchedulerTCB->state == WAITING) {
+    coSchedulerSleeping = 0;
+    if (coSchedulerTCB->currentQueue != NULL) {
+      removeFromList(coSchedulerTCB);
+    }
+    unblockTask(coSchedulerTCB);
+  }
+}
+
+// This should only be called atomically
+void readyCoroutine(coroutine_t *co) {
+  co->next = NULL;
+  if (coReadyHead == NULL) {
+    coReadyHead = co;
+  } else {
+    coReadyTail->next = co;
+  }
+  coReadyTail = co;
+  wakeCoroutineScheduler();
+}
+
+coroutine_t *popReadyCoroutine(void) {
+  __disable_irq();
+  // sleepers that are due go to the back of the ready list first
+  while (coSleeping != NULL && (int32_t)(rtosTickCounter - coSleeping->wakeTick) >= 0) {
+    coroutine_t *co = coSleeping;
+    coSleeping = co->next;
+    readyCoroutine(co);
+  }
+  coroutine_t *co = coReadyHead;
+  if (co != NULL) {
+    coReadyHead = co->next;
+    co->next = NULL;
+  }
+  __enable_irq();
+  return co;
+}
+
+rtosStatus_t coSchedulerSleep(void) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (coReadyHead == NULL && (coSleeping == NULL || (int32_t)(coSleeping->wakeTick - rtosTickCounter) > 0)) {
+    // sleep until the first sleeper is due, or until something readies a coroutine
+    coSchedulerSleeping = 1;
+    runningTCB->state = WAITING;
+    if (coSleeping != NULL) {
+      runningTCB->waitTicks = coSleeping->wakeTick - rtosTickCounter;
+      addToList(runningTCB, waitingTaskPriorityQueue);
+    }
+    forceContextSwitch();
+  }
+  __enable_irq();
+  coSchedulerSleeping = 0;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+void coSchedulerTask(void *args) {
+  while (1) {
+    coroutine_t *co;
+    while ((co = popReadyCoroutine()) != NULL) {
+      // waiting coroutines have already been queued on what they wait for, finished ones are just dropped
+      if (co->func(co) == CO_READY) {
+        __disable_irq();
+        readyCoroutine(co);
+        __enable_irq();
+      }
+    }
+    coSchedulerSleep();
+  }
+}
+
+rtosStatus_t rtosCoroutineSchedulerInit(taskPriority_t priority) {
+  if (coSchedulerTCB != NULL) {
+    // already running
+    return RTOS_OK;
+  }
+  if (numTasks == 0) {
+    return RTOS_NOT_INIT;
+  }
+  if (priority >= NUM_PRIORITIES || priority == EDF_PRIORITY) {
+    return RTOS_INVALID_PRIORITY;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  // take the TCB in the same atomic step that creates it, so no coroutine can try to wake it before it is known
+  coSchedulerTCB = createTask(coSchedulerTask, NULL, priority, 0, NULL);
+  __enable_irq();
+  rtosExitFunction();
+  if (coSchedulerTCB == NULL) {
+    return RTOS_MAX_TASKS;
+  }
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosCoroutineStart(coroutine_t *co, rtosCoroutineFunc_t func, void *arg) {
+  if (coSchedulerTCB == NULL) {
+    // nobody to run it
+    return RTOS_NOT_INIT;
+  }
+  co->func = func;
+  co->arg = arg;
+  co->line = 0;
+  __disable_irq();
+  readyCoroutine(co);
+  __enable_irq();
+  return RTOS_OK;
+}
+
+// Only called by a running coroutine, through CO_WAIT_SEMAPHORE
+rtosStatus_t rtosCoroutineTakeSemaphore(coroutine_t *co, semaphore_t *sem) {
+  rtosStatus_t status = RTOS_OK;
+  __disable_irq();
+  if (sem->count > 0) {
+    // semaphore is open
+    sem->count--;
+  } else {
+    // park behind any other coroutines, the signaller hands the count over when it readies this one
+    co->next = NULL;
+    if (sem->coWaitersHead == NULL) {
+      sem->coWaitersHead = co;
+    } else {
+      sem->coWaitersTail->next = co;
+    }
+    sem->coWaitersTail = co;
+    status = RTOS_SEMAPHORE_CLOSED;
+  }
+  __enable_irq();
+  return status;
+}
+
+// Only called by a running coroutine, through CO_SLEEP
+rtosStatus_t rtosCoroutineSleep(coroutine_t *co, uint32_t ticks) {
+  __disable_irq();
+  co->wakeTick = rtosTickCounter + ticks;
+  // keep sleepers sorted by wake tick, after any that wake at the same tick
+  coroutine_t **link = &coSleeping;
+  while (*link != NULL && (int32_t)((*link)->wakeTick - co->wakeTick) <= 0) {
+    link = &((*link)->next);
+  }
+  co->next = *link;
+  *link = co;
+  __enable_irq();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSemaphoreInit(semaphore_t *sem, uint32_t count) {
+  rtosEnterFunction();
+  sem->count = count;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    sem->waitingPriorityQueue[priority].head = NULL;
+    sem->waitingPriorityQueue[priority].tail = NULL;
+  }
+  sem->coWaitersHead = NULL;
+  sem->coWaitersTail = NULL;
+  sem->selectWaiters = 0;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosWaitOnSemaphore(semaphore_t *sem) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (sem->count > 0) {
+    // semaphore is open
+    sem->count--;
+  } else {
+    // semaphore is closed, wait until it is signalled
+    runningTCB->state = WAITING;
+    addToList(runningTCB, sem->waitingPriorityQueue);
+    forceContextSwitch();
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void releaseSemaphoreWaiters(semaphore_t *sem) {
+  // hand out available counts to waiting tasks, the woken task does not decrement it again
+  TCB_t *unblockedTask;
+  while (sem->count > 0 && (unblockedTask = popFromList(sem->waitingPriorityQueue)) != NULL) {
+    sem->count--;
+    releaseTask(unblockedTask);
+  }
+  if (sem->count > 0) {
+    wakeSelectWaiters(&(sem->selectWaiters));
+  }
+  // coroutines only get what the tasks leave behind
+  while (sem->count > 0 && sem->coWaitersHead != NULL) {
+    coroutine_t *co = sem->coWaitersHead;
+    sem->coWaitersHead = co->next;
+    sem->count--;
+    readyCoroutine(co);
+  }
+}
+
+void semaphoreDeferred(void *sem) { releaseSemaphoreWaiters((semaphore_t *)sem); }
+
+rtosStatus_t rtosSignalSemaphore(semaphore_t *sem) {
+  rtosEnterFunction();
+  __disable_irq();
+  sem->count++;
+
+  // check if there is a task waiting for semaphore
+  releaseSemaphoreWaiters(sem);
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSignalSemaphoreN(semaphore_t *sem, uint32_t n) {
+  rtosEnterFunction();
+  __disable_irq();
+  sem->count += n;
+
+  // wake up to n waiting tasks in this one call
+  releaseSemaphoreWaiters(sem);
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosBroadcastSemaphore(semaphore_t *sem) {
+  rtosEnterFunction();
+  __disable_irq();
+  // let every waiting task through without leaving any count behind
+  TCB_t *unblockedTask;
+  while ((unblockedTask = popFromList(sem->waitingPriorityQueue)) != NULL) {
+    releaseTask(unblockedTask);
+  }
+  while (sem->coWaitersHead != NULL) {
+    coroutine_t *co = sem->coWaitersHead;
+    sem->coWaitersHead = co->next;
+    readyCoroutine(co);
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// ISR variants never switch context themselves, so they skip rtosEnterFunction,
+// and they restore PRIMASK instead of enabling interrupts in case they are nested
+rtosStatus_t rtosSignalSemaphoreFromISR(semaphore_t *sem) { return rtosSignalSemaphoreNFromISR(sem, 1); }
+
+rtosStatus_t rtosSignalSemaphoreNFromISR(semaphore_t *sem, uint32_t n) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  // only count the signal if PendSV will get to hand it out
+  rtosStatus_t status = deferCall(semaphoreDeferred, sem);
+  if (status == RTOS_OK) {
+    sem->count += n;
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+void rtcDispatcherTask(void *args) {
+  rtcDispatcher_t *dispatcher = (rtcDispatcher_t *)args;
+  while (1) {
+    // one count per queued activation
+    rtosWaitOnSemaphore(&(dispatcher->sem));
+    __disable_irq();
+    rtcTask_t *task = dispatcher->head;
+    dispatcher->head = task->next;
+    if (dispatcher->head == NULL) {
+      dispatcher->tail = NULL;
+    }
+    task->next = NULL;
+    // can be activated again as soon as it starts
+    task->pending = 0;
+    __enable_irq();
+
+    // jobs run one after another on this task's stack, only a higher priority dispatcher can preempt them
+    task->job(task->arg);
+  }
+}
+
+// This should only be called atomically
+void queueRtcTask(rtcTask_t *task) {
+  rtcDispatcher_t *dispatcher = task->dispatcher;
+  task->next = NULL;
+  task->pending = 1;
+  if (dispatcher->head == NULL) {
+    dispatcher->head = task;
+  } else {
+    dispatcher->tail->next = task;
+  }
+  dispatcher->tail = task;
+}
+
+rtosStatus_t rtosRtcDispatcherInit(rtcDispatcher_t *dispatcher, taskPriority_t priority) {
+  rtosSemaphoreInit(&(dispatcher->sem), 0);
+  dispatcher->head = NULL;
+  dispatcher->tail = NULL;
+  return rtosThreadNew(rtcDispatcherTask, dispatcher, priority);
+}
+
+rtosStatus_t rtosRtcTaskInit(rtcTask_t *task, rtcDispatcher_t *dispatcher, rtosTaskFunc_t job, void *arg) {
+  task->job = job;
+  task->arg = arg;
+  task->dispatcher = dispatcher;
+  task->pending = 0;
+  task->next = NULL;
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosRtcActivate(rtcTask_t *task) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (!task->pending) {
+    // an activation while one is still queued is folded into it
+    queueRtcTask(task);
+    task->dispatcher->sem.count++;
+    releaseSemaphoreWaiters(&(task->dispatcher->sem));
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosRtcActivateFromISR(rtcTask_t *task) {
+  rtosStatus_t status = RTOS_OK;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (!task->pending) {
+    status = rtosSignalSemaphoreFromISR(&(task->dispatcher->sem));
+    if (status == RTOS_OK) {
+      queueRtcTask(task);
+    }
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+void workerTask(void *args) {
+  workQueue_t *queue = (workQueue_t *)args;
+  while (1) {
+    // one count per queued item, so every worker that gets through has an item to take
+    rtosWaitOnSemaphore(&(queue->sem));
+    __disable_irq();
+    workItem_t *item = queue->head;
+    queue->head = item->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+    item->next = NULL;
+    // can be submitted again as soon as it starts
+    item->pending = 0;
+    __enable_irq();
+
+    item->func(item);
+  }
+}
+
+// This should only be called atomically
+void queueWorkItem(workQueue_t *queue, workItem_t *item) {
+  item->pending = 1;
+  if (queue->order == WORK_PRIORITY) {
+    // highest priority first, fifo among items with the same priority
+    workItem_t **link = &(queue->head);
+    while (*link != NULL && (*link)->priority <= item->priority) {
+      link = &((*link)->next);
+    }
+    item->next = *link;
+    *link = item;
+    if (item->next == NULL) {
+      queue->tail = item;
+    }
+  } else {
+    item->next = NULL;
+    if (queue->head == NULL) {
+      queue->head = item;
+    } else {
+      queue->tail->next = item;
+    }
+    queue->tail = item;
+  }
+}
+
+rtosStatus_t rtosWorkQueueInit(workQueue_t *queue, workOrder_t order) {
+  rtosSemaphoreInit(&(queue->sem), 0);
+  queue->head = NULL;
+  queue->tail = NULL;
+  queue->order = order;
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosWorkQueueAddWorker(workQueue_t *queue, taskPriority_t priority) {
+  return rtosThreadNew(workerTask, queue, priority);
+}
+
+rtosStatus_t rtosWorkItemInit(workItem_t *item, rtosWorkFunc_t func, void *arg, taskPriority_t priority) {
+  item->func = func;
+  item->arg = arg;
+  item->priority = priority;
+  item->pending = 0;
+  item->next = NULL;
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSubmitWork(workQueue_t *queue, workItem_t *item) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (!item->pending) {
+    // an item that is already queued runs once for both submits
+    queueWorkItem(queue, item);
+    queue->sem.count++;
+    releaseSemaphoreWaiters(&(queue->sem));
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSubmitWorkFromISR(workQueue_t *queue, workItem_t *item) {
+  rtosStatus_t status = RTOS_OK;
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (!item->pending) {
+    status = rtosSignalSemaphoreFromISR(&(queue->sem));
+    if (status == RTOS_OK) {
+      queueWorkItem(queue, item);
+    }
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+void threadedIrqTask(void *args) {
+  threadedIrq_t *irq = (threadedIrq_t *)args;
+  while (1) {
+    rtosWaitOnSemaphore(&(irq->sem));
+    irq->handler(irq->arg);
+    // the line was masked by rtosThreadedIrqDispatch, if the device still wants service it pends again now
+    NVIC_EnableIRQ(irq->irq);
+  }
+}
+
+rtosStatus_t rtosThreadedIrqInit(threadedIrq_t *irq, IRQn_Type irqNum, rtosTaskFunc_t handler, void *arg,
+                                 taskPriority_t priority) {
+  irq->irq = irqNum;
+  irq->handler = handler;
+  irq->arg = arg;
+  rtosSemaphoreInit(&(irq->sem), 0);
+  return rtosThreadNew(threadedIrqTask, irq, priority);
+}
+
+rtosStatus_t rtosThreadedIrqDispatch(threadedIrq_t *irq) {
+  // keep the line masked until the handler task has run, so it can't fire again in the meantime
+  NVIC_DisableIRQ(irq->irq);
+  rtosStatus_t status = rtosSignalSemaphoreFromISR(&(irq->sem));
+  if (status != RTOS_OK) {
+    // nothing will run the handler, so leave the line on and let it fire again
+    NVIC_EnableIRQ(irq->irq);
+  }
+  return status;
+}
+
+rtosStatus_t rtosRingBufferInit(ringBuffer_t *ring, uint8_t *buffer, uint32_t size) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    // indices wrap with a mask, so the size has to be a power of two
+    return RTOS_INVALID_SIZE;
+  }
+  ring->buffer = buffer;
+  ring->mask = size - 1;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->consumerWaiting = 0;
+  rtosSemaphoreInit(&(ring->dataSem), 0);
+  return RTOS_OK;
+}
+
+// Only the producer moves head and only the consumer moves tail, so neither side needs to lock
+rtosStatus_t rtosRingBufferPut(ringBuffer_t *ring, uint8_t data) {
+  uint32_t head = ring->head;
+  if (head - ring->tail > ring->mask) {
+    return RTOS_QUEUE_FULL;
+  }
+  ring->buffer[head & ring->mask] = data;
+  // the byte has to be written before the consumer can see the new head
+  __DMB();
+  ring->head = head + 1;
+
+  if (ring->consumerWaiting) {
+    ring->consumerWaiting = 0;
+    if (rtosSignalSemaphoreFromISR(&(ring->dataSem)) != RTOS_OK) {
+      // couldn't wake it this time, the next put tries again
+      ring->consumerWaiting = 1;
+    }
+  }
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosRingBufferGet(ringBuffer_t *ring, uint8_t *data, uint8_t wait) {
+  while (ring->head == ring->tail) {
+    if (!wait || numTasks == 0) {
+      return RTOS_BUFFER_EMPTY;
+    }
+    ring->consumerWaiting = 1;
+    __DMB();
+    // check again now the producer can see the flag, a put in between has either been seen here or will signal
+    if (ring->head == ring->tail) {
+      rtosWaitOnSemaphore(&(ring->dataSem));
+    }
+    ring->consumerWaiting = 0;
+  }
+  uint32_t tail = ring->tail;
+  *data = ring->buffer[tail & ring->mask];
+  // the byte has to be read before the producer can reuse its slot
+  __DMB();
+  ring->tail = tail + 1;
+  return RTOS_OK;
+}
+
+uint32_t rtosRingBufferCount(ringBuffer_t *ring) { return ring->head - ring->tail; }
+
+rtosStatus_t rtosMutexInit(mutex_t *mutex) {
+  rtosEnterFunction();
+  mutex->owner = NO_OWNER;
+  mutex->recursive = 0;
+  mutex->nesting = 0;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    mutex->waitingPriorityQueue[priority].head = NULL;
+    mutex->waitingPriorityQueue[priority].tail = NULL;
+    mutex->storedPriority = NO_PRIORITY;
+  }
+  mutex->deadlineInherited = 0;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosRecursiveMutexInit(mutex_t *mutex) {
+  rtosEnterFunction();
+  rtosMutexInit(mutex);
+  // the owner can take it again, and has to release it as many times
+  mutex->recursive = 1;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// Give the mutex to task if it is free, otherwise queue task on it and elevate the owner.
+// Returns 1 if task now owns the mutex. This should only be called atomically
+uint8_t acquireMutexOrQueue(mutex_t *mutex, TCB_t *task) {
+  if (mutex->owner == NO_OWNER) {
+    mutex->owner = task->id;
+    return 1;
+  }
+
+  // mutex already owned
+  if (TCBList[mutex->owner].taskPriority > task->taskPriority) {
+    // keep the original priority if the owner was already elevated by another waiter
+    if (mutex->storedPriority == NO_PRIORITY) {
+      mutex->storedPriority = priorityToRestore(&(TCBList[mutex->owner]));
+    }
+    // elevate mutex owner priority to level of the waiting task
+    setTaskPriority(&(TCBList[mutex->owner]), task->taskPriority);
+  } else if (TCBList[mutex->owner].taskPriority == EDF_PRIORITY && task->taskPriority == EDF_PRIORITY &&
+             TCBList[mutex->owner].relativeDeadline != 0 && task->relativeDeadline != 0 &&
+             deadlineBefore(task, &(TCBList[mutex->owner]))) {
+    // both in the EDF band, so the owner inherits the earlier deadline instead
+    TCB_t *owner = &(TCBList[mutex->owner]);
+    if (!mutex->deadlineInherited) {
+      mutex->deadlineInherited = 1;
+      // keep the owner's own deadline until it gives back every mutex it inherited through
+      if (owner->inheritedDeadlines++ == 0) {
+        owner->storedDeadline = owner->absoluteDeadline;
+      }
+    }
+    setTaskDeadline(owner, task->absoluteDeadline);
+  }
+
+  task->state = WAITING;
+  addToList(task, mutex->waitingPriorityQueue);
+  return 0;
+}
+
+// Hand the mutex to its highest priority waiter, or free it. This should only be called atomically
+void giveMutex(mutex_t *mutex) {
+  if (mutex->storedPriority != NO_PRIORITY) { // if need to restore unelevated priority
+    // return elevated task to original priority
+    restorePriority(&(TCBList[mutex->owner]), mutex->storedPriority);
+    // reset stored priority
+    mutex->storedPriority = NO_PRIORITY;
+  }
+  if (mutex->deadlineInherited) {
+    TCB_t *owner = &(TCBList[mutex->owner]);
+    if (--owner->inheritedDeadlines == 0) {
+      setTaskDeadline(owner, owner->storedDeadline);
+    }
+    mutex->deadlineInherited = 0;
+  }
+
+  TCB_t *unblockedTask = popFromList(mutex->waitingPriorityQueue);
+  if (unblockedTask != NULL) {
+    // the highest priority waiter becomes the owner, so nobody left waiting outranks it
+    mutex->owner = unblockedTask->id;
+    unblockTask(unblockedTask);
+  } else {
+    // Nothing waiting on mutex
+    mutex->owner = NO_OWNER;
+  }
+  mutex->nesting = 0;
+}
+
+rtosStatus_t rtosAcquireMutex(mutex_t *mutex) {
+  if (numTasks == 0) {
+    // rtos not initialized, so there is nobody to lock out yet
+    return RTOS_NOT_INIT;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  if (mutex->owner == runningTCB->id) {
+    if (!mutex->recursive) {
+      // queueing on our own mutex would never return
+      __enable_irq();
+      rtosExitFunction();
+      return RTOS_MUTEX_ALREADY_OWNED;
+    }
+    mutex->nesting++;
+  } else if (!acquireMutexOrQueue(mutex, runningTCB)) {
+    // the releasing task hands the mutex straight to us
+    forceContextSwitch();
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosReleaseMutex(mutex_t *mutex) {
+  if (numTasks == 0) {
+    // rtos not initialized
+    return RTOS_NOT_INIT;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  if (mutex->owner != runningTCB->id) {
+    // cannot release a mutex you do not own
+    __enable_irq();
+    rtosExitFunction();
+    return RTOS_MUTEX_NOT_OWNED;
+  }
+
+  if (mutex->nesting > 0) {
+    // still held by an outer acquire
+    mutex->nesting--;
+  } else {
+    giveMutex(mutex);
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosCondVarInit(condVar_t *cond) {
+  rtosEnterFunction();
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    cond->waitingPriorityQueue[priority].head = NULL;
+    cond->waitingPriorityQueue[priority].tail = NULL;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosCondWait(condVar_t *cond, mutex_t *mutex) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (mutex->owner != runningTCB->id) {
+    // must hold the mutex the condition is checked under
+    __enable_irq();
+    rtosExitFunction();
+    return RTOS_MUTEX_NOT_OWNED;
+  }
+
+  // release the mutex and start waiting in one step, so no signal can be missed in between,
+  // a recursive mutex is released fully and gets its nesting back once reacquired
+  runningTCB->condNesting = mutex->nesting;
+  giveMutex(mutex);
+  runningTCB->condMutex = mutex;
+  runningTCB->state = WAITING;
+  addToList(runningTCB, cond->waitingPriorityQueue);
+  forceContextSwitch();
+  __enable_irq();
+  // by the time we run again we own the mutex again
+  mutex->nesting = runningTCB->condNesting;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void wakeCondWaiter(TCB_t *task) {
+  // move the waiter onto its mutex instead of waking it just to block again,
+  // queueing there elevates the mutex owner like any other waiter would
+  if (acquireMutexOrQueue(task->condMutex, task)) {
+    unblockTask(task);
+  }
+}
+
+rtosStatus_t rtosCondSignal(condVar_t *cond) {
+  rtosEnterFunction();
+  __disable_irq();
+  TCB_t *signalledTask = popFromList(cond->waitingPriorityQueue);
+  if (signalledTask != NULL) {
+    wakeCondWaiter(signalledTask);
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosCondBroadcast(condVar_t *cond) {
+  rtosEnterFunction();
+  __disable_irq();
+  TCB_t *signalledTask;
+  while ((signalledTask = popFromList(cond->waitingPriorityQueue)) != NULL) {
+    wakeCondWaiter(signalledTask);
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosRWLockInit(rwLock_t *lock) {
+  rtosEnterFunction();
+  lock->writer = NO_OWNER;
+  lock->storedPriority = NO_PRIORITY;
+  lock->readers = 0;
+  lock->boostedReaders = 0;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    lock->waitingReadQueue[priority].head = NULL;
+    lock->waitingReadQueue[priority].tail = NULL;
+    lock->waitingWriteQueue[priority].head = NULL;
+    lock->waitingWriteQueue[priority].tail = NULL;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+uint8_t writerWaiting(rwLock_t *lock) {
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    if (lock->waitingWriteQueue[priority].head != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Elevate whoever holds the lock to the priority of a task about to wait on it.
+// This should only be called atomically
+void elevateRWLockHolders(rwLock_t *lock, taskPriority_t priority) {
+  if (lock->writer != NO_OWNER) {
+    if (TCBList[lock->writer].taskPriority > priority) {
+      // keep the original priority if the writer was already elevated
+      if (lock->storedPriority == NO_PRIORITY) {
+        lock->storedPriority = priorityToRestore(&(TCBList[lock->writer]));
+      }
+      setTaskPriority(&(TCBList[lock->writer]), priority);
+    }
+    return;
+  }
+
+  // only a writer waits on readers, elevate every reader in its way
+  for (uint8_t id = 0; id < numTasks; id++) {
+    if ((lock->readers & (1UL << id)) && TCBList[id].taskPriority > priority) {
+      // keep the priority from before the first boost this lock gave the reader
+      if (!(lock->boostedReaders & (1UL << id))) {
+        lock->boostedReaders |= (1UL << id);
+        lock->readerStoredPriority[id] = priorityToRestore(&(TCBList[id]));
+      }
+      setTaskPriority(&(TCBList[id]), priority);
+    }
+  }
+}
+
+rtosStatus_t rtosAcquireReadLock(rwLock_t *lock) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (lock->writer == NO_OWNER && !writerWaiting(lock)) {
+    lock->readers |= (1UL << runningTCB->id);
+  } else {
+    // writers go first, wait until they are all done
+    elevateRWLockHolders(lock, runningTCB->taskPriority);
+    runningTCB->state = WAITING;
+    addToList(runningTCB, lock->waitingReadQueue);
+    forceContextSwitch();
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosReleaseReadLock(rwLock_t *lock) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (!(lock->readers & (1UL << runningTCB->id))) {
+    // cannot release a lock you do not hold
+    __enable_irq();
+    rtosExitFunction();
+    return RTOS_MUTEX_NOT_OWNED;
+  }
+
+  lock->readers &= ~(1UL << runningTCB->id);
+  if (lock->boostedReaders & (1UL << runningTCB->id)) {
+    // return elevated reader to original priority
+    lock->boostedReaders &= ~(1UL << runningTCB->id);
+    restorePriority(runningTCB, lock->readerStoredPriority[runningTCB->id]);
+  }
+
+  if (lock->readers == 0) {
+    // last reader out lets the highest priority writer in
+    TCB_t *unblockedTask = popFromList(lock->waitingWriteQueue);
+    if (unblockedTask != NULL) {
+      lock->writer = unblockedTask->id;
+      unblockTask(unblockedTask);
+    }
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosAcquireWriteLock(rwLock_t *lock) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (lock->writer == NO_OWNER && lock->readers == 0) {
+    lock->writer = runningTCB->id;
+  } else {
+    // wait for the current writer or readers, elevating them so they finish sooner
+    elevateRWLockHolders(lock, runningTCB->taskPriority);
+    runningTCB->state = WAITING;
+    addToList(runningTCB, lock->waitingWriteQueue);
+    forceContextSwitch();
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosReleaseWriteLock(rwLock_t *lock) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (lock->writer != runningTCB->id) {
+    // cannot release a lock you do not hold
+    __enable_irq();
+    rtosExitFunction();
+    return RTOS_MUTEX_NOT_OWNED;
+  }
+
+  if (lock->storedPriority != NO_PRIORITY) {
+    // return elevated writer to original priority
+    restorePriority(runningTCB, lock->storedPriority);
+    lock->storedPriority = NO_PRIORITY;
+  }
+
+  TCB_t *unblockedTask = popFromList(lock->waitingWriteQueue);
+  if (unblockedTask != NULL) {
+    // writers are preferred, hand the lock straight to the next one
+    lock->writer = unblockedTask->id;
+    unblockTask(unblockedTask);
+  } else {
+    // no writers left, let every waiting reader in at once
+    lock->writer = NO_OWNER;
+    while ((unblockedTask = popFromList(lock->waitingReadQueue)) != NULL) {
+      lock->readers |= (1UL << unblockedTask->id);
+      unblockTask(unblockedTask);
+    }
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosBarrierInit(barrier_t *barrier, uint32_t n) {
+  rtosEnterFunction();
+  barrier->count = 0;
+  barrier->n = n;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    barrier->waitingPriorityQueue[priority].head = NULL;
+    barrier->waitingPriorityQueue[priority].tail = NULL;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSyncOnBarrier(barrier_t *barrier) {
+  rtosEnterFunction();
+  __disable_irq();
+  barrier->count++;
+  if (barrier->count < barrier->n) {
+    // wait for the rest to arrive
+    runningTCB->state = WAITING;
+    addToList(runningTCB, barrier->waitingPriorityQueue);
+    forceContextSwitch();
+  } else {
+    // last to arrive, let everyone through and reset so the barrier can be used again straight away
+    TCB_t *unblockedTask;
+    while ((unblockedTask = popFromList(barrier->waitingPriorityQueue)) != NULL) {
+      unblockTask(unblockedTask);
+    }
+    barrier->count = 0;
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosMsgQueueInit(msgQueue_t *queue, void **buffer, uint32_t capacity) {
+  if (buffer == NULL || capacity == 0) {
+    // a queue with no slots would leave every sender and receiver blocked forever
+    return RTOS_INVALID_SIZE;
+  }
+  rtosEnterFunction();
+  queue->buffer = buffer;
+  queue->capacity = capacity;
+  queue->count = 0;
+  queue->head = 0;
+  queue->selectWaiters = 0;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    queue->waitingSendQueue[priority].head = NULL;
+    queue->waitingSendQueue[priority].tail = NULL;
+    queue->waitingReceiveQueue[priority].head = NULL;
+    queue->waitingReceiveQueue[priority].tail = NULL;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void pushToQueue(msgQueue_t *queue, void *message) {
+  queue->buffer[(queue->head + queue->count) % queue->capacity] = message;
+  queue->count++;
+}
+
+// This should only be called atomically
+void *popFromQueue(msgQueue_t *queue) {
+  void *message = queue->buffer[queue->head];
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  return message;
+}
+
+// This should only be called atomically
+void releaseQueueReceivers(msgQueue_t *queue) {
+  // hand queued messages straight to waiting receivers, highest priority first
+  TCB_t *unblockedTask;
+  while (queue->count > 0 && (unblockedTask = popFromList(queue->waitingReceiveQueue)) != NULL) {
+    unblockedTask->message = popFromQueue(queue);
+    releaseTask(unblockedTask);
+  }
+  if (queue->count > 0) {
+    wakeSelectWaiters(&(queue->selectWaiters));
+  }
+}
+
+// This should only be called atomically
+void *takeFromQueue(msgQueue_t *queue) {
+  void *message = popFromQueue(queue);
+
+  // room opened up, move the message of the highest priority blocked sender in
+  TCB_t *unblockedTask = popFromList(queue->waitingSendQueue);
+  if (unblockedTask != NULL) {
+    pushToQueue(queue, unblockedTask->message);
+    unblockTask(unblockedTask);
+  }
+  return message;
+}
+
+void queueDeferred(void *queue) { releaseQueueReceivers((msgQueue_t *)queue); }
+
+rtosStatus_t rtosSendToQueue(msgQueue_t *queue, void *message) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (queue->count < queue->capacity) {
+    // there is room, receivers only wait on an empty queue so this wakes at most one
+    pushToQueue(queue, message);
+    releaseQueueReceivers(queue);
+  } else {
+    // queue is full, park the message with the task until a receiver makes room
+    runningTCB->message = message;
+    runningTCB->state = WAITING;
+    addToList(runningTCB, queue->waitingSendQueue);
+    forceContextSwitch();
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSendToQueueFromISR(msgQueue_t *queue, void *message) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (queue->count == queue->capacity) {
+    // interrupts can not wait for room
+    __set_PRIMASK(primask);
+    return RTOS_QUEUE_FULL;
+  }
+  // only queue the message if PendSV will get to hand it out
+  rtosStatus_t status = deferCall(queueDeferred, queue);
+  if (status == RTOS_OK) {
+    pushToQueue(queue, message);
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+rtosStatus_t rtosReceiveFromQueue(msgQueue_t *queue, void **message) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (queue->count > 0) {
+    runningTCB->message = takeFromQueue(queue);
+  } else {
+    // queue is empty, the next sender will hand its message straight to us
+    runningTCB->state = WAITING;
+    addToList(runningTCB, queue->waitingReceiveQueue);
+    forceContextSwitch();
+  }
+  __enable_irq();
+  *message = runningTCB->message;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosEventGroupInit(eventGroup_t *group) {
+  rtosEnterFunction();
+  group->bits = 0;
+  group->selectWaiters = 0;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    group->waitingPriorityQueue[priority].head = NULL;
+    group->waitingPriorityQueue[priority].tail = NULL;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+uint8_t eventBitsSatisfied(uint32_t groupBits, uint32_t waitBits, uint8_t flags) {
+  if (flags & EVENT_WAIT_ALL) {
+    return (groupBits & waitBits) == waitBits;
+  }
+  return (groupBits & waitBits) != 0;
+}
+
+// This should only be called atomically
+void releaseEventGroupWaiters(eventGroup_t *group) {
+  // every waiter is checked against the same bits, and clearing happens once everyone has been woken
+  uint32_t clearBits = 0;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    TCB_t *TCB_ptr = group->waitingPriorityQueue[priority].head;
+    TCB_t *TCB_prev_ptr = NULL;
+    while (TCB_ptr != NULL) {
+      if (eventBitsSatisfied(group->bits, TCB_ptr->eventBits, TCB_ptr->eventFlags)) {
+        if (TCB_ptr->eventFlags & EVENT_CLEAR_ON_EXIT) {
+          clearBits |= TCB_ptr->eventBits;
+        }
+        // hand back the bits that woke the task
+        TCB_ptr->eventBits = group->bits;
+        unlinkFromList(&(group->waitingPriorityQueue[priority]), TCB_prev_ptr);
+        releaseTask(TCB_ptr);
+        TCB_ptr = (TCB_prev_ptr == NULL) ? group->waitingPriorityQueue[priority].head : TCB_prev_ptr->next;
+      } else {
+        TCB_prev_ptr = TCB_ptr;
+        TCB_ptr = TCB_ptr->next;
+      }
+    }
+  }
+  group->bits &= ~clearBits;
+  if (group->bits != 0) {
+    wakeSelectWaiters(&(group->selectWaiters));
+  }
+}
+
+void eventGroupDeferred(void *group) { releaseEventGroupWaiters((eventGroup_t *)group); }
+
+rtosStatus_t rtosWaitOnEventGroup(eventGroup_t *group, uint32_t bits, uint8_t flags, uint32_t *setBits) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (eventBitsSatisfied(group->bits, bits, flags)) {
+    runningTCB->eventBits = group->bits;
+    if (flags & EVENT_CLEAR_ON_EXIT) {
+      group->bits &= ~bits;
+    }
+  } else {
+    // wait until enough bits are set, the setter will fill in eventBits
+    runningTCB->eventBits = bits;
+    runningTCB->eventFlags = flags;
+    runningTCB->state = WAITING;
+    addToList(runningTCB, group->waitingPriorityQueue);
+    forceContextSwitch();
+  }
+  __enable_irq();
+  if (setBits != NULL) {
+    *setBits = runningTCB->eventBits;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSetEventBits(eventGroup_t *group, uint32_t bits) {
+  rtosEnterFunction();
+  __disable_irq();
+  group->bits |= bits;
+  releaseEventGroupWaiters(group);
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+uint32_t *selectWaitersOf(rtosWaitObject_t *object) {
+  switch (object->type) {
+  case WAIT_SEMAPHORE:
+    return &(((semaphore_t *)object->object)->selectWaiters);
+  case WAIT_QUEUE:
+    return &(((msgQueue_t *)object->object)->selectWaiters);
+  default:
+    return &(((eventGroup_t *)object->object)->selectWaiters);
+  }
+}
+
+// Take from the first object that has something, returns its index or SELECT_NONE
+// This should only be called atomically
+uint8_t trySelect(rtosWaitObject_t *objects, uint8_t count) {
+  for (uint8_t i = 0; i < count; i++) {
+    if (objects[i].type == WAIT_SEMAPHORE) {
+      semaphore_t *sem = (semaphore_t *)objects[i].object;
+      if (sem->count > 0) {
+        sem->count--;
+        return i;
+      }
+    } else if (objects[i].type == WAIT_QUEUE) {
+      msgQueue_t *queue = (msgQueue_t *)objects[i].object;
+      if (queue->count > 0) {
+        objects[i].message = takeFromQueue(queue);
+        return i;
+      }
+    } else {
+      eventGroup_t *group = (eventGroup_t *)objects[i].object;
+      if (eventBitsSatisfied(group->bits, objects[i].bits, objects[i].flags)) {
+        objects[i].setBits = group->bits;
+        if (objects[i].flags & EVENT_CLEAR_ON_EXIT) {
+          group->bits &= ~objects[i].bits;
+        }
+        return i;
+      }
+    }
+  }
+  return SELECT_NONE;
+}
+
+// Check every object once and sleep for up to ticks if none of them had anything, the result is left in selectFired
+rtosStatus_t selectSleep(rtosWaitObject_t *objects, uint8_t count, uint32_t ticks) {
   rtosEnterFunction();
   __disable_irq();
-  if (mutex->owner != runningTCB->id) {
-    // cannot release a mutex you do not own
-    rtosExitFunction();
-    return RTOS_MUTEX_NOT_OWNED;
+  runningTCB->selectFired = trySelect(objects, count);
+  if (runningTCB->selectFired == SELECT_NONE && ticks != 0) {
+    // put our id on every object, whichever fires first wakes us
+    for (uint8_t i = 0; i < count; i++) {
+      *selectWaitersOf(&(objects[i])) |= (1UL << runningTCB->id);
+    }
+    runningTCB->selectWaiting = 1;
+    runningTCB->state = WAITING;
+    if (ticks != WAIT_FOREVER) {
+      runningTCB->waitTicks = ticks;
+      addToList(runningTCB, waitingTaskPriorityQueue);
+    }
+    forceContextSwitch();
+    __enable_irq();
+
+    // woken by an object or the timeout, either way take our id back off and check again
+    __disable_irq();
+    runningTCB->selectWaiting = 0;
+    for (uint8_t i = 0; i < count; i++) {
+      *selectWaitersOf(&(objects[i])) &= ~(1UL << runningTCB->id);
+    }
+    runningTCB->selectFired = trySelect(objects, count);
   }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
 
-  if (mutex->storedPriority != NO_PRIORITY) { // if need to restore unelevated priority
-    // return elevated task to original priority
-    TCBList[mutex->owner].taskPriority = mutex->storedPriority;
-    // reset stored priority
-    mutex->storedPriority = NO_PRIORITY;
+rtosStatus_t rtosWaitOnMultiple(rtosWaitObject_t *objects, uint8_t count, uint32_t timeout, uint8_t *fired) {
+  if (numTasks == 0) {
+    // rtos not initialized
+    return RTOS_NOT_INIT;
+  }
+  uint32_t deadline = rtosTickCounter + timeout;
+  uint32_t ticks = timeout;
+  while (1) {
+    selectSleep(objects, count, ticks);
+    if (runningTCB->selectFired != SELECT_NONE) {
+      *fired = runningTCB->selectFired;
+      return RTOS_OK;
+    }
+    // another task got to what woke us first, wait out whatever is left of the timeout
+    if (timeout != WAIT_FOREVER) {
+      if ((int32_t)(deadline - rtosTickCounter) <= 0) {
+        return RTOS_TIMEOUT;
+      }
+      ticks = deadline - rtosTickCounter;
+    }
   }
+}
 
-  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
-    if (mutex->waitingPriorityQueue[priority].head != NULL) {
-      TCB_t *unblockedTask = mutex->waitingPriorityQueue[priority].head;
+rtosStatus_t rtosSetEventBitsFromISR(eventGroup_t *group, uint32_t bits) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  rtosStatus_t status = deferCall(eventGroupDeferred, group);
+  __set_PRIMASK(primask);
+  if (status != RTOS_OK) {
+    return status;
+  }
 
-      mutex->waitingPriorityQueue[priority].head = unblockedTask->next;
-      if (unblockedTask->next == NULL) { // if the only task in list
-        mutex->waitingPriorityQueue[priority].tail = NULL;
+  // PendSV can not check the waiters before we return, so the bits can be set after queueing
+  if ((uint32_t)&(group->bits) >= SRAM_BB_BASE && (uint32_t)&(group->bits) < SRAM_BB_END) {
+    for (uint8_t bit = 0; bit < 32; bit++) {
+      if (bits & (1UL << bit)) {
+        *BIT_BAND_ALIAS(&(group->bits), bit) = 1;
       }
-      mutex->owner = unblockedTask->id;
+    }
+  } else {
+    // outside the bit-band region, fall back to masking interrupts
+    __disable_irq();
+    group->bits |= bits;
+    __set_PRIMASK(primask);
+  }
+  return RTOS_OK;
+}
 
-      // set task to ready state and queue in ready task queue
-      unblockedTask->next = NULL;
-      unblockedTask->state = READY;
-      addToList(unblockedTask, readyTaskPriorityQueue);
-      __enable_irq();
-      rtosExitFunction();
-      return RTOS_OK;
+rtosStatus_t rtosClearEventBits(eventGroup_t *group, uint32_t bits) {
+  rtosEnterFunction();
+  __disable_irq();
+  group->bits &= ~bits;
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosMemPoolInit(memPool_t *pool, void *buffer, uint32_t blockSize, uint32_t numBlocks) {
+  rtosEnterFunction();
+  // every free block holds the pointer to the next one, so keep them word sized and aligned
+  blockSize = (blockSize + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (blockSize == 0) {
+    blockSize = sizeof(void *);
+  }
+
+  // thread every block onto the free list
+  pool->freeList = NULL;
+  for (uint32_t i = numBlocks; i > 0; i--) {
+    void **block = (void **)((uint8_t *)buffer + (i - 1) * blockSize);
+    *block = pool->freeList;
+    pool->freeList = block;
+  }
+  pool->blockSize = blockSize;
+  pool->numFree = numBlocks;
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    pool->waitingPriorityQueue[priority].head = NULL;
+    pool->waitingPriorityQueue[priority].tail = NULL;
+  }
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void *popFromPool(memPool_t *pool) {
+  void **block = (void **)pool->freeList;
+  pool->freeList = *block;
+  pool->numFree--;
+  return block;
+}
+
+// This should only be called atomically
+void pushToPool(memPool_t *pool, void *block) {
+  *(void **)block = pool->freeList;
+  pool->freeList = block;
+  pool->numFree++;
+}
+
+// This should only be called atomically
+void releasePoolWaiters(memPool_t *pool) {
+  // hand free blocks straight to waiting tasks, highest priority first
+  TCB_t *unblockedTask;
+  while (pool->freeList != NULL && (unblockedTask = popFromList(pool->waitingPriorityQueue)) != NULL) {
+    unblockedTask->message = popFromPool(pool);
+    unblockTask(unblockedTask);
+  }
+}
+
+void poolDeferred(void *pool) { releasePoolWaiters((memPool_t *)pool); }
+
+uint8_t poolWaiting(memPool_t *pool) {
+  for (taskPriority_t priority = HIGHEST_PRIORITY; priority < NUM_PRIORITIES; priority++) {
+    if (pool->waitingPriorityQueue[priority].head != NULL) {
+      return 1;
     }
   }
+  return 0;
+}
 
-  // Nothing waiting on mutex
-  mutex->owner = NO_OWNER;
+rtosStatus_t rtosMemPoolAlloc(memPool_t *pool, void **block, uint8_t wait) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (pool->freeList != NULL) {
+    runningTCB->message = popFromPool(pool);
+  } else if (wait) {
+    // pool is empty, the next free hands its block straight to us
+    runningTCB->state = WAITING;
+    addToList(runningTCB, pool->waitingPriorityQueue);
+    forceContextSwitch();
+  } else {
+    __enable_irq();
+    rtosExitFunction();
+    return RTOS_POOL_EMPTY;
+  }
   __enable_irq();
+  *block = runningTCB->message;
   rtosExitFunction();
   return RTOS_OK;
 }
 
-rtosStatus_t rtosWait(uint32_t ticks) {
+rtosStatus_t rtosMemPoolAllocFromISR(memPool_t *pool, void **block) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (pool->freeList == NULL) {
+    __set_PRIMASK(primask);
+    return RTOS_POOL_EMPTY;
+  }
+  *block = popFromPool(pool);
+  __set_PRIMASK(primask);
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosMemPoolFree(memPool_t *pool, void *block) {
+  rtosEnterFunction();
+  __disable_irq();
+  pushToPool(pool, block);
+  releasePoolWaiters(pool);
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosMemPoolFreeFromISR(memPool_t *pool, void *block) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  rtosStatus_t status = RTOS_OK;
+  if (poolWaiting(pool)) {
+    // only give the block back if PendSV will get to hand it to a waiter, so a retry can't free it twice
+    status = deferCall(poolDeferred, pool);
+  }
+  if (status == RTOS_OK) {
+    pushToPool(pool, block);
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+uint8_t rtosGetTaskId(void) { return runningTCB->id; }
+
+// This should only be called atomically
+void releaseNotifyWaiter(TCB_t *task) {
+  if (task->notifyWaiting && task->notifyValue != 0) {
+    task->notifyWaiting = 0;
+    releaseTask(task);
+  }
+}
+
+void notifyDeferred(void *task) { releaseNotifyWaiter((TCB_t *)task); }
+
+rtosStatus_t rtosNotify(uint8_t taskId) {
+  if (taskId >= numTasks) {
+    return RTOS_INVALID_TASK;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  TCBList[taskId].notifyValue++;
+  releaseNotifyWaiter(&(TCBList[taskId]));
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosNotifyBits(uint8_t taskId, uint32_t bits) {
+  if (taskId >= numTasks) {
+    return RTOS_INVALID_TASK;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  TCBList[taskId].notifyValue |= bits;
+  releaseNotifyWaiter(&(TCBList[taskId]));
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosNotifyFromISR(uint8_t taskId) {
+  if (taskId >= numTasks) {
+    return RTOS_INVALID_TASK;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  rtosStatus_t status = deferCall(notifyDeferred, &(TCBList[taskId]));
+  if (status == RTOS_OK) {
+    TCBList[taskId].notifyValue++;
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+rtosStatus_t rtosNotifyBitsFromISR(uint8_t taskId, uint32_t bits) {
+  if (taskId >= numTasks) {
+    return RTOS_INVALID_TASK;
+  }
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  rtosStatus_t status = deferCall(notifyDeferred, &(TCBList[taskId]));
+  if (status == RTOS_OK) {
+    TCBList[taskId].notifyValue |= bits;
+  }
+  __set_PRIMASK(primask);
+  return status;
+}
+
+rtosStatus_t rtosWaitOnNotify(uint8_t clearOnExit, uint32_t *value) {
+  rtosEnterFunction();
+  __disable_irq();
+  while (runningTCB->notifyValue == 0) {
+    // nothing yet, the task waits in no queue so notifying it only needs its id
+    runningTCB->notifyWaiting = 1;
+    runningTCB->state = WAITING;
+    forceContextSwitch();
+    // let the switch happen, we are back once notified but check again before taking a count
+    __enable_irq();
+    __disable_irq();
+  }
+  runningTCB->notifyWaiting = 0;
+  if (value != NULL) {
+    *value = runningTCB->notifyValue;
+  }
+  // take everything, or a single count when used as a semaphore
+  if (clearOnExit) {
+    runningTCB->notifyValue = 0;
+  } else {
+    runningTCB->notifyValue--;
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+uint32_t rtosGetTickCount(void) { return rtosTickCounter; }
+
+rtosStatus_t rtosSetTimeSlice(uint8_t taskId, uint32_t ticks) {
+  if (taskId >= numTasks) {
+    return RTOS_INVALID_TASK;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  TCBList[taskId].timeSlice = ticks;
+  if (runningTCB == &(TCBList[taskId])) {
+    // start the new quantum now rather than at whatever the old one had left
+    nextTimeSlice = rtosTickCounter + taskTimeSlice(runningTCB);
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosSetPriorityTimeSlice(taskPriority_t priority, uint32_t ticks) {
+  if (priority >= NUM_PRIORITIES || priority == EDF_PRIORITY) {
+    return RTOS_INVALID_PRIORITY;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  priorityTimeSlice[priority] = ticks;
+  if (runningTCB->timeSlice == TIME_SLICE_FROM_PRIORITY && runningTCB->taskPriority == priority) {
+    nextTimeSlice = rtosTickCounter + ticks;
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void insertTimer(rtosTimer_t *timer) {
+  // keep active timers sorted by expiry, after any that expire at the same tick
+  rtosTimer_t **link = &activeTimers;
+  while (*link != NULL && (int32_t)((*link)->expiry - timer->expiry) <= 0) {
+    link = &((*link)->next);
+  }
+  timer->next = *link;
+  *link = timer;
+}
+
+// This should only be called atomically
+void removeTimer(rtosTimer_t *timer) {
+  rtosTimer_t **link = &activeTimers;
+  while (*link != timer) {
+    link = &((*link)->next);
+  }
+  *link = timer->next;
+  timer->next = NULL;
+}
+
+// This should only be called atomically
+void wakeTimerService(void) {
+  // only wake it from its own sleep, a callback may have it waiting on something else
+  if (timerServiceSleeping && timerServiceTCB->state == WAITING) {
+    timerServiceSleeping = 0;
+    if (timerServiceTCB->currentQueue != NULL) {
+      removeFromList(timerServiceTCB);
+    }
+    unblockTask(timerServiceTCB);
+  }
+}
+
+void runDueTimers(void) {
+  __disable_irq();
+  while (activeTimers != NULL && (int32_t)(rtosTickCounter - activeTimers->expiry) >= 0) {
+    rtosTimer_t *timer = activeTimers;
+    activeTimers = timer->next;
+    if (timer->period != 0) {
+      // periodic timers are rearmed off their last expiry so they never drift
+      timer->expiry += timer->period;
+      insertTimer(timer);
+    } else {
+      timer->next = NULL;
+      timer->active = 0;
+    }
+
+    // callbacks run with interrupts on, and may start or stop timers themselves
+    __enable_irq();
+    timer->callback(timer->arg);
+    __disable_irq();
+  }
+  __enable_irq();
+}
+
+rtosStatus_t timerServiceSleep(void) {
   rtosEnterFunction();
   __disable_irq();
+  if (activeTimers == NULL || (int32_t)(activeTimers->expiry - rtosTickCounter) > 0) {
+    // sleep on the kernel's wait queue until the next timer is due, or until woken for an earlier one
+    timerServiceSleeping = 1;
+    runningTCB->state = WAITING;
+    if (activeTimers != NULL) {
+      runningTCB->waitTicks = activeTimers->expiry - rtosTickCounter;
+      addToList(runningTCB, waitingTaskPriorityQueue);
+    }
+    forceContextSwitch();
+  }
+  __enable_irq();
+  timerServiceSleeping = 0;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+void timerServiceTask(void *args) {
+  while (1) {
+    runDueTimers();
+    timerServiceSleep();
+  }
+}
+
+rtosStatus_t rtosTimerServiceInit(taskPriority_t priority) {
+  if (timerServiceTCB != NULL) {
+    // already running
+    return RTOS_OK;
+  }
   if (numTasks == 0) {
-    // rtos not initialized
     return RTOS_NOT_INIT;
   }
+  if (priority >= NUM_PRIORITIES || priority == EDF_PRIORITY) {
+    return RTOS_INVALID_PRIORITY;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  // take the TCB in the same atomic step that creates it, so nothing can start a timer before it is known
+  timerServiceTCB = createTask(timerServiceTask, NULL, priority, 0, NULL);
+  __enable_irq();
+  rtosExitFunction();
+  if (timerServiceTCB == NULL) {
+    return RTOS_MAX_TASKS;
+  }
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosTimerInit(rtosTimer_t *timer, rtosTimerFunc_t callback, void *arg) {
+  rtosEnterFunction();
+  timer->callback = callback;
+  timer->arg = arg;
+  timer->period = 0;
+  timer->expiry = 0;
+  timer->active = 0;
+  timer->next = NULL;
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosTimerStart(rtosTimer_t *timer, uint32_t ticks, uint32_t period) {
+  if (timerServiceTCB == NULL) {
+    // nobody to run the callback
+    return RTOS_NOT_INIT;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  if (timer->active) {
+    // restarting, drop the old expiry
+    removeTimer(timer);
+  }
+  timer->period = period;
+  timer->expiry = rtosTickCounter + ticks;
+  timer->active = 1;
+  insertTimer(timer);
+
+  // the service sleeps until the old first timer, so wake it if this one is due sooner
+  if (activeTimers == timer) {
+    wakeTimerService();
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosTimerStop(rtosTimer_t *timer) {
+  rtosEnterFunction();
+  __disable_irq();
+  if (timer->active) {
+    // the service just wakes up early if this was the first timer
+    removeTimer(timer);
+    timer->active = 0;
+  }
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+// This should only be called atomically
+void sleepRunningTask(uint32_t ticks) {
+  // a wait of 0 ticks would wrap around in SysTick_Handler, so just don't sleep
+  if (ticks == 0) {
+    return;
+  }
   runningTCB->waitTicks = ticks;
   runningTCB->state = WAITING;
   addToList(runningTCB, waitingTaskPriorityQueue);
   forceContextSwitch();
+}
+
+rtosStatus_t rtosWait(uint32_t ticks) {
+  if (numTasks == 0) {
+    // rtos not initialized
+    return RTOS_NOT_INIT;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  sleepRunningTask(ticks);
+  __enable_irq();
+  rtosExitFunction();
+  return RTOS_OK;
+}
+
+rtosStatus_t rtosWaitUntil(uint32_t wakeTick) {
+  if (numTasks == 0) {
+    // rtos not initialized
+    return RTOS_NOT_INIT;
+  }
+  rtosEnterFunction();
+  __disable_irq();
+  // work out the ticks left with interrupts off, so a tick can't slip in between
+  // a wake tick that has already passed doesn't sleep at all
+  if ((int32_t)(wakeTick - rtosTickCounter) > 0) {
+    sleepRunningTask(wakeTick - rtosTickCounter);
+  }
   __enable_irq();
   rtosExitFunction();
   return RTOS_OK;
 }
 
+rtosStatus_t rtosWaitPeriod(uint32_t *lastWake, uint32_t period) {
+  // next wake is relative to the last one, not to now, so time spent running never adds up
+  *lastWake += period;
+  return rtosWaitUntil(*lastWake);
+}
+
+rtosStatus_t rtosDeferFromISR(rtosDeferredFunc_t func, void *arg) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  rtosStatus_t status = deferCall(func, arg);
+  __set_PRIMASK(primask);
+  return status;
+}
+
 __asm void rtosEnterFunction(void) {
 		PUSH{R4 - R11}
 		BX LR
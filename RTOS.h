@@ -9,12 +9,58 @@ typedef enum {
   NUM_PRIORITIES = NO_PRIORITY
 } taskPriority_t;
 
+// EDF tasks all run in this band, ordered by absolute deadline instead of fifo, so it is closed to rtosThreadNew
+#define EDF_PRIORITY ((taskPriority_t)(DEFAULT_PRIORITY - 1))
+
 typedef enum { RUNNING, READY, WAITING, SUSPENDED } taskState_t;
 
-typedef enum { RTOS_OK, RTOS_NOT_INIT, RTOS_MAX_TASKS, RTOS_MUTEX_NOT_OWNED } rtosStatus_t;
+// what happens to a task that uses up its budget before the next refill
+typedef enum { BUDGET_DEMOTE, BUDGET_SUSPEND } rtosBudgetAction_t;
+
+typedef enum { EVENT_WAIT_ANY = 0x0, EVENT_WAIT_ALL = 0x1, EVENT_CLEAR_ON_EXIT = 0x2 } eventWaitFlags_t;
+
+typedef enum {
+  RTOS_OK,
+  RTOS_NOT_INIT,
+  RTOS_MAX_TASKS,
+  RTOS_MUTEX_NOT_OWNED,
+  RTOS_MUTEX_ALREADY_OWNED,
+  RTOS_ISR_QUEUE_FULL,
+  RTOS_QUEUE_FULL,
+  RTOS_INVALID_TASK,
+  RTOS_POOL_EMPTY,
+  RTOS_INVALID_PARTITION,
+  RTOS_INVALID_FRAME,
+  RTOS_SEMAPHORE_CLOSED,
+  RTOS_TIMEOUT,
+  RTOS_INVALID_SIZE,
+  RTOS_BUFFER_EMPTY,
+  RTOS_INVALID_PRIORITY,
+  RTOS_INVALID_DEADLINE,
+  RTOS_INVALID_PERIOD
+} rtosStatus_t;
+
+// timeout for rtosWaitOnMultiple that never runs out, a timeout of 0 only checks the objects once
+#define WAIT_FOREVER 0xFFFFFFFF
+// selectFired when no object has fired
+#define SELECT_NONE 0xFF
+
+#define MAX_NUM_TASKS 6
+
+#define MAX_PARTITIONS 4
+// tasks in this partition run in every window, which is where all tasks start
+#define PARTITION_ALL 0xFF
+
+// a cyclic job's frames is a bitmask of the minor frames it runs in
+#define MAX_CYCLIC_FRAMES 32
+
+// a task with this time slice uses the slice of the priority it is running at, a slice of 0 is FIFO
+#define TIME_SLICE_FROM_PRIORITY 0xFFFFFFFF
 
 typedef struct TCB TCB_t;
 typedef struct tcbQueue tcbQueue_t;
+typedef struct mutex mutex_t;
+typedef struct rtosPeriodicTask rtosPeriodicTask_t;
 
 struct tcbQueue {
   TCB_t *head;
@@ -26,38 +72,385 @@ struct TCB {
   uint32_t baseOfStack;
   uint32_t stackPointer;
   taskPriority_t taskPriority;
+  taskPriority_t basePriority;
   uint32_t waitTicks;
+  uint32_t timeSlice;
+  uint32_t relativeDeadline;
+  uint32_t absoluteDeadline;
+  uint8_t inheritedDeadlines;
+  uint32_t storedDeadline;
+  rtosPeriodicTask_t *periodic;
+  uint32_t budget;
+  uint32_t budgetPeriod;
+  uint32_t budgetRemaining;
+  uint32_t budgetRefill;
+  rtosBudgetAction_t budgetAction;
+  uint8_t budgetExhausted;
+  uint8_t partition;
+  uint8_t selectWaiting;
+  uint8_t selectFired;
   taskState_t state;
   tcbQueue_t *currentQueue;
+  void *message;
+  uint32_t eventBits;
+  uint8_t eventFlags;
+  uint32_t notifyValue;
+  uint8_t notifyWaiting;
+  mutex_t *condMutex;
+  uint32_t condNesting;
   TCB_t *next;
 };
 
 typedef void (*rtosTaskFunc_t)(void *args);
 
+// called from SysTick_Handler the tick a job reaches its deadline unfinished, must be short and must never block
+typedef void (*rtosDeadlineMissFunc_t)(uint8_t taskId);
+
+// job runs once per period, the counters can be read at any time
+struct rtosPeriodicTask {
+  rtosTaskFunc_t job;
+  void *arg;
+  uint32_t period;
+  uint32_t deadline;
+  uint32_t wcet;
+  TCB_t *tcb;
+  uint32_t release;
+  uint32_t jobTicks;
+  uint8_t jobActive;
+  uint8_t jobMissed;
+  uint32_t jobsReleased;
+  uint32_t jobsCompleted;
+  uint32_t deadlineMisses;
+  uint32_t wcetOverruns;
+  uint32_t maxJobTicks;
+};
+
+typedef void (*rtosTimerFunc_t)(void *arg);
+
+// called from SysTick_Handler the tick a minor frame ends with its jobs still running, must be short
+typedef void (*rtosOverrunFunc_t)(uint8_t frame);
+
 typedef struct {
-  uint8_t count;
+  rtosTaskFunc_t job;
+  void *arg;
+  uint32_t frames;
+} rtosCyclicJob_t;
+
+typedef struct rtosTimer rtosTimer_t;
+
+// period is 0 for one-shot timers, expiry is the tick the timer is next due
+struct rtosTimer {
+  rtosTimerFunc_t callback;
+  void *arg;
+  uint32_t period;
+  uint32_t expiry;
+  uint8_t active;
+  rtosTimer_t *next;
+};
+
+// runs in PendSV with interrupts disabled, so it must be short and must never block
+typedef void (*rtosDeferredFunc_t)(void *arg);
+
+typedef enum { CO_READY, CO_WAITING, CO_DONE } coState_t;
+
+typedef struct coroutine coroutine_t;
+
+// returns where the coroutine got to, the CO_ macros take care of this
+typedef coState_t (*rtosCoroutineFunc_t)(coroutine_t *co);
+
+// everything a coroutine keeps between runs, locals are lost at every CO_ wait so keep state in arg
+struct coroutine {
+  rtosCoroutineFunc_t func;
+  void *arg;
+  uint16_t line;
+  uint32_t wakeTick;
+  coroutine_t *next;
+};
+
+typedef struct {
+  uint32_t count;
   tcbQueue_t waitingPriorityQueue[NUM_PRIORITIES];
+  coroutine_t *coWaitersHead;
+  coroutine_t *coWaitersTail;
+  uint32_t selectWaiters;
 } semaphore_t;
 
+typedef struct rtcTask rtcTask_t;
+
+// one per priority level, every run-to-completion task at that level shares its stack
+typedef struct {
+  semaphore_t sem;
+  rtcTask_t *head;
+  rtcTask_t *tail;
+} rtcDispatcher_t;
+
+struct rtcTask {
+  rtosTaskFunc_t job;
+  void *arg;
+  rtcDispatcher_t *dispatcher;
+  uint8_t pending;
+  rtcTask_t *next;
+};
+
+typedef enum { WORK_FIFO, WORK_PRIORITY } workOrder_t;
+
+typedef struct workItem workItem_t;
+
+typedef void (*rtosWorkFunc_t)(workItem_t *item);
+
+// owned by the submitter, and can't be submitted to a second queue while it is pending on one
+struct workItem {
+  rtosWorkFunc_t func;
+  void *arg;
+  taskPriority_t priority;
+  uint8_t pending;
+  workItem_t *next;
+};
+
+typedef struct {
+  semaphore_t sem;
+  workItem_t *head;
+  workItem_t *tail;
+  workOrder_t order;
+} workQueue_t;
+
+// the ISR acknowledges the device and calls rtosThreadedIrqDispatch, handler then runs in its own task
 typedef struct {
+  IRQn_Type irq;
+  rtosTaskFunc_t handler;
+  void *arg;
+  semaphore_t sem;
+} threadedIrq_t;
+
+// single producer single consumer byte ring, head and tail run freely and are masked on access
+typedef struct {
+  uint8_t *buffer;
+  uint32_t mask;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint8_t consumerWaiting;
+  semaphore_t dataSem;
+} ringBuffer_t;
+
+// protothread style, a coroutine body is CO_BEGIN(co); ... CO_END(co); with a switch on the line to resume from,
+// so the CO_ macros can't be used inside a switch of the coroutine's own
+#define CO_BEGIN(co)                                                                                                   \
+  switch ((co)->line) {                                                                                                \
+  case 0:
+#define CO_END(co)                                                                                                     \
+  }                                                                                                                    \
+  (co)->line = 0;                                                                                                      \
+  return CO_DONE
+#define CO_YIELD(co)                                                                                                   \
+  do {                                                                                                                 \
+    (co)->line = __LINE__;                                                                                             \
+    return CO_READY;                                                                                                   \
+  case __LINE__:;                                                                                                      \
+  } while (0)
+#define CO_SLEEP(co, ticks)                                                                                            \
+  do {                                                                                                                 \
+    (co)->line = __LINE__;                                                                                             \
+    rtosCoroutineSleep((co), (ticks));                                                                                 \
+    return CO_WAITING;                                                                                                 \
+  case __LINE__:;                                                                                                      \
+  } while (0)
+#define CO_WAIT_SEMAPHORE(co, sem)                                                                                     \
+  do {                                                                                                                 \
+    (co)->line = __LINE__;                                                                                             \
+    if (rtosCoroutineTakeSemaphore((co), (sem)) != RTOS_OK) {                                                          \
+      return CO_WAITING;                                                                                               \
+    }                                                                                                                  \
+  case __LINE__:;                                                                                                      \
+  } while (0)
+
+struct mutex {
   int8_t owner;
   taskPriority_t storedPriority;
+  uint8_t deadlineInherited;
+  uint8_t recursive;
+  uint32_t nesting;
+  tcbQueue_t waitingPriorityQueue[NUM_PRIORITIES];
+};
+
+typedef struct {
+  tcbQueue_t waitingPriorityQueue[NUM_PRIORITIES];
+} condVar_t;
+
+// readers is a bitmask of task ids currently holding the lock for reading
+typedef struct {
+  int8_t writer;
+  taskPriority_t storedPriority;
+  uint32_t readers;
+  uint32_t boostedReaders;
+  // what each boosted reader goes back to when it releases the lock
+  taskPriority_t readerStoredPriority[MAX_NUM_TASKS];
+  tcbQueue_t waitingReadQueue[NUM_PRIORITIES];
+  tcbQueue_t waitingWriteQueue[NUM_PRIORITIES];
+} rwLock_t;
+
+typedef struct {
+  void **buffer;
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t head;
+  tcbQueue_t waitingSendQueue[NUM_PRIORITIES];
+  tcbQueue_t waitingReceiveQueue[NUM_PRIORITIES];
+  uint32_t selectWaiters;
+} msgQueue_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t n;
+  tcbQueue_t waitingPriorityQueue[NUM_PRIORITIES];
+} barrier_t;
+
+typedef struct {
+  void *freeList;
+  uint32_t blockSize;
+  uint32_t numFree;
   tcbQueue_t waitingPriorityQueue[NUM_PRIORITIES];
-} mutex_t;
+} memPool_t;
+
+// ISRs set bits with bit-band writes when the group lives in AHB SRAM (0x2007C000)
+typedef struct {
+  uint32_t bits;
+  tcbQueue_t waitingPriorityQueue[NUM_PRIORITIES];
+  uint32_t selectWaiters;
+} eventGroup_t;
+
+typedef enum { WAIT_SEMAPHORE, WAIT_QUEUE, WAIT_EVENT_GROUP } waitObjectType_t;
+
+// bits and flags are only used for event groups, message and setBits are filled in for whichever object fired
+typedef struct {
+  waitObjectType_t type;
+  void *object;
+  uint32_t bits;
+  uint8_t flags;
+  void *message;
+  uint32_t setBits;
+} rtosWaitObject_t;
 
 void rtosInit(void);
 
+// EDF_PRIORITY is refused, it is only for EDF tasks
 rtosStatus_t rtosThreadNew(rtosTaskFunc_t func, void *arg, taskPriority_t taskPriority);
+// relativeDeadline must not be 0, waking from a sleep or signal releases a job due relativeDeadline ticks later
+rtosStatus_t rtosThreadNewEDF(rtosTaskFunc_t func, void *arg, uint32_t relativeDeadline);
+// at EDF_PRIORITY the job deadlines are also what EDF schedules by, wcet is only checked against not enforced
+rtosStatus_t rtosThreadNewPeriodic(rtosPeriodicTask_t *task, rtosTaskFunc_t job, void *arg, taskPriority_t priority,
+                                   uint32_t period, uint32_t deadline, uint32_t wcet);
+rtosStatus_t rtosSetDeadlineMissHook(rtosDeadlineMissFunc_t hook);
+// task may run for budget ticks every period ticks, then it is demoted to LOWEST_PRIORITY or suspended until the
+// refill, a budget of 0 is unlimited. The budget can't be more than the period, and the idle task can't be suspended
+rtosStatus_t rtosSetTaskBudget(uint8_t taskId, uint32_t budget, uint32_t period, rtosBudgetAction_t action);
+// windowTicks[i] is how long partition i runs each major frame, windows run in order starting now
+rtosStatus_t rtosPartitionsInit(const uint32_t *windowTicks, uint8_t count);
+// partition must be PARTITION_ALL or below the count given to rtosPartitionsInit, the idle task can't be moved
+rtosStatus_t rtosSetTaskPartition(uint8_t taskId, uint8_t partition);
+// Runs table from the calling task forever, every frame starts minorFrameTicks after the last one. No other task
+// runs again, so jobs must run to completion and never block. Only returns if it couldn't start
+rtosStatus_t rtosCyclicExecutiveStart(const rtosCyclicJob_t *table, uint8_t numJobs, uint8_t numFrames,
+                                      uint32_t minorFrameTicks);
+rtosStatus_t rtosSetOverrunHook(rtosOverrunFunc_t hook);
+uint32_t rtosGetCyclicOverruns(void);
+rtosStatus_t rtosCoroutineSchedulerInit(taskPriority_t priority);
+rtosStatus_t rtosCoroutineStart(coroutine_t *co, rtosCoroutineFunc_t func, void *arg);
+// used by the CO_ macros, not to be called directly
+rtosStatus_t rtosCoroutineTakeSemaphore(coroutine_t *co, semaphore_t *sem);
+rtosStatus_t rtosCoroutineSleep(coroutine_t *co, uint32_t ticks);
+// run-to-completion jobs must never block, that would hold up every job on the same dispatcher
+rtosStatus_t rtosRtcDispatcherInit(rtcDispatcher_t *dispatcher, taskPriority_t priority);
+rtosStatus_t rtosRtcTaskInit(rtcTask_t *task, rtcDispatcher_t *dispatcher, rtosTaskFunc_t job, void *arg);
+rtosStatus_t rtosRtcActivate(rtcTask_t *task);
+rtosStatus_t rtosRtcActivateFromISR(rtcTask_t *task);
+rtosStatus_t rtosWorkQueueInit(workQueue_t *queue, workOrder_t order);
+rtosStatus_t rtosWorkQueueAddWorker(workQueue_t *queue, taskPriority_t priority);
+// priority only orders items on a WORK_PRIORITY queue, the worker's own priority is what it runs at
+rtosStatus_t rtosWorkItemInit(workItem_t *item, rtosWorkFunc_t func, void *arg, taskPriority_t priority);
+rtosStatus_t rtosSubmitWork(workQueue_t *queue, workItem_t *item);
+rtosStatus_t rtosSubmitWorkFromISR(workQueue_t *queue, workItem_t *item);
+rtosStatus_t rtosThreadedIrqInit(threadedIrq_t *irq, IRQn_Type irqNum, rtosTaskFunc_t handler, void *arg,
+                                 taskPriority_t priority);
+rtosStatus_t rtosThreadedIrqDispatch(threadedIrq_t *irq);
+// size must be a power of two. Put can be called from one ISR or task, and Get from one task, without locking
+rtosStatus_t rtosRingBufferInit(ringBuffer_t *ring, uint8_t *buffer, uint32_t size);
+rtosStatus_t rtosRingBufferPut(ringBuffer_t *ring, uint8_t data);
+// with wait set, blocks until there is data, unless the rtos isn't running yet
+rtosStatus_t rtosRingBufferGet(ringBuffer_t *ring, uint8_t *data, uint8_t wait);
+uint32_t rtosRingBufferCount(ringBuffer_t *ring);
 
-rtosStatus_t rtosSemaphoreInit(semaphore_t *sem, uint8_t count);
+rtosStatus_t rtosSemaphoreInit(semaphore_t *sem, uint32_t count);
 rtosStatus_t rtosWaitOnSemaphore(semaphore_t *sem);
 rtosStatus_t rtosSignalSemaphore(semaphore_t *sem);
+rtosStatus_t rtosSignalSemaphoreN(semaphore_t *sem, uint32_t n);
+rtosStatus_t rtosBroadcastSemaphore(semaphore_t *sem);
+rtosStatus_t rtosSignalSemaphoreFromISR(semaphore_t *sem);
+rtosStatus_t rtosSignalSemaphoreNFromISR(semaphore_t *sem, uint32_t n);
 
 rtosStatus_t rtosMutexInit(mutex_t *mutex);
+rtosStatus_t rtosRecursiveMutexInit(mutex_t *mutex);
 rtosStatus_t rtosAcquireMutex(mutex_t *mutex);
 rtosStatus_t rtosReleaseMutex(mutex_t *mutex);
 
+rtosStatus_t rtosCondVarInit(condVar_t *cond);
+rtosStatus_t rtosCondWait(condVar_t *cond, mutex_t *mutex);
+rtosStatus_t rtosCondSignal(condVar_t *cond);
+rtosStatus_t rtosCondBroadcast(condVar_t *cond);
+
+rtosStatus_t rtosRWLockInit(rwLock_t *lock);
+rtosStatus_t rtosAcquireReadLock(rwLock_t *lock);
+rtosStatus_t rtosReleaseReadLock(rwLock_t *lock);
+rtosStatus_t rtosAcquireWriteLock(rwLock_t *lock);
+rtosStatus_t rtosReleaseWriteLock(rwLock_t *lock);
+
+rtosStatus_t rtosBarrierInit(barrier_t *barrier, uint32_t n);
+rtosStatus_t rtosSyncOnBarrier(barrier_t *barrier);
+
+rtosStatus_t rtosMsgQueueInit(msgQueue_t *queue, void **buffer, uint32_t capacity);
+rtosStatus_t rtosSendToQueue(msgQueue_t *queue, void *message);
+rtosStatus_t rtosSendToQueueFromISR(msgQueue_t *queue, void *message);
+rtosStatus_t rtosReceiveFromQueue(msgQueue_t *queue, void **message);
+
+rtosStatus_t rtosEventGroupInit(eventGroup_t *group);
+rtosStatus_t rtosWaitOnEventGroup(eventGroup_t *group, uint32_t bits, uint8_t flags, uint32_t *setBits);
+rtosStatus_t rtosSetEventBits(eventGroup_t *group, uint32_t bits);
+rtosStatus_t rtosSetEventBitsFromISR(eventGroup_t *group, uint32_t bits);
+rtosStatus_t rtosClearEventBits(eventGroup_t *group, uint32_t bits);
+
+// waits until any of the objects fires and takes from it, fired is its index in objects
+rtosStatus_t rtosWaitOnMultiple(rtosWaitObject_t *objects, uint8_t count, uint32_t timeout, uint8_t *fired);
+
+rtosStatus_t rtosMemPoolInit(memPool_t *pool, void *buffer, uint32_t blockSize, uint32_t numBlocks);
+rtosStatus_t rtosMemPoolAlloc(memPool_t *pool, void **block, uint8_t wait);
+rtosStatus_t rtosMemPoolAllocFromISR(memPool_t *pool, void **block);
+rtosStatus_t rtosMemPoolFree(memPool_t *pool, void *block);
+rtosStatus_t rtosMemPoolFreeFromISR(memPool_t *pool, void *block);
+
+uint8_t rtosGetTaskId(void);
+rtosStatus_t rtosNotify(uint8_t taskId);
+rtosStatus_t rtosNotifyBits(uint8_t taskId, uint32_t bits);
+rtosStatus_t rtosNotifyFromISR(uint8_t taskId);
+rtosStatus_t rtosNotifyBitsFromISR(uint8_t taskId, uint32_t bits);
+rtosStatus_t rtosWaitOnNotify(uint8_t clearOnExit, uint32_t *value);
+
+uint32_t rtosGetTickCount(void);
+
+rtosStatus_t rtosSetTimeSlice(uint8_t taskId, uint32_t ticks);
+// EDF tasks are ordered by deadline, not time sliced, so EDF_PRIORITY is refused
+rtosStatus_t rtosSetPriorityTimeSlice(taskPriority_t priority, uint32_t ticks);
+
+rtosStatus_t rtosTimerServiceInit(taskPriority_t priority);
+rtosStatus_t rtosTimerInit(rtosTimer_t *timer, rtosTimerFunc_t callback, void *arg);
+rtosStatus_t rtosTimerStart(rtosTimer_t *timer, uint32_t ticks, uint32_t period);
+rtosStatus_t rtosTimerStop(rtosTimer_t *timer);
+
 rtosStatus_t rtosWait(uint32_t ticks);
+// sleep until the tick counter reaches wakeTick, returns straight away if it already has
+rtosStatus_t rtosWaitUntil(uint32_t wakeTick);
+// for periodic loops, set lastWake to rtosGetTickCount() once before the loop
+rtosStatus_t rtosWaitPeriod(uint32_t *lastWake, uint32_t period);
+
+rtosStatus_t rtosDeferFromISR(rtosDeferredFunc_t func, void *arg);
 
 void rtosEnterFunction(void);
 void rtosExitFunction(void);
@@ -13,6 +13,8 @@
  * Copyright (c) 2009 Keil - An ARM Company. All rights reserved.
  *----------------------------------------------------------------------------*/
 
+#include <LPC17xx.h>
+#include "RTOS.h"
 #include <rt_misc.h>
 #include <stdio.h>
 
@@ -137,6 +139,37 @@ int ferror(FILE *f) {
 
 void _ttywrch(int ch) { sendchar(ch); }
 
+/*----------------------------------------------------------------------------
+Locks the C library takes around its own state (stdio streams and so on).
+Returning nonzero from _mutex_initialize makes the library thread safe.
+*----------------------------------------------------------------------------*/
+#define LIB_MUTEX_COUNT 8
+
+mutex_t libMutexes[LIB_MUTEX_COUNT];
+uint8_t numLibMutexes = 0;
+
+int _mutex_initialize(void **m) {
+  // the library can set up locks with interrupts masked, so leave them as they were
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (numLibMutexes == LIB_MUTEX_COUNT) {
+    // out of mutexes, this one stays unlocked
+    __set_PRIMASK(primask);
+    return 0;
+  }
+  *m = &(libMutexes[numLibMutexes++]);
+  __set_PRIMASK(primask);
+  rtosRecursiveMutexInit((mutex_t *)*m);
+  return 1;
+}
+
+// both do nothing until rtosInit, when there is only one thread anyway
+void _mutex_acquire(void **m) { rtosAcquireMutex((mutex_t *)*m); }
+
+void _mutex_release(void **m) { rtosReleaseMutex((mutex_t *)*m); }
+
+void _mutex_free(void **m) {}
+
 void _sys_exit(int return_code) {
 
 label:
@@ -13,39 +13,39 @@ const char name2[] = "Melvin";
 mutex_t draw_mutex;
 semaphore_t draw_sem;
 uint8_t readyOrder;
-const uint8_t testTaskCount = 4;
-typedef struct {
-  semaphore_t turnstile;
-  mutex_t mutex;
-  uint32_t count, n;
-} barrier_t;
+const uint8_t testTaskCount = 3;
 barrier_t barrier;
 
 semaphore_t sneakySem;
 
-// non reusable barrier
-void syncOnBarrier(barrier_t *barrier) {
-  rtosEnterFunction();
-  // increase barrier's count by acquiring the mutex
-  rtosAcquireMutex(&(barrier->mutex));
-  barrier->count++;
-  rtosReleaseMutex(&(barrier->mutex));
-
-  // if count = n, then we are the last to sync, so signal semaphore
-  if (barrier->count == barrier->n) {
-    rtosSignalSemaphore(&(barrier->turnstile));
-  }
+// recursive, so the logging helpers can call each other while holding it
+mutex_t log_mutex;
 
-  // wait on the turnstile, and signal it when you go through
-  rtosWaitOnSemaphore(&(barrier->turnstile));
-  rtosSignalSemaphore(&(barrier->turnstile));
-  rtosExitFunction();
-}
+rtosTimer_t ledTimer;
+uint32_t ledCount;
 
-// Task that creates a clock on the LEDs on the board
-void ledTimerTask(void *args) {
-  unsigned char taskName[] = "ledTimerTask";
+// Timer callback that creates a clock on the LEDs on the board
+void ledTimerCallback(void *arg) {
+  // write count to leds, going through each bit
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    if (ledCount & (1 << bit)) {
+      if (bit <= 4) {
+        LPC_GPIO2->FIOSET = (1UL << led_pos2[bit]);
+      } else {
+        LPC_GPIO1->FIOSET = (1UL << led_pos1[bit - 5]);
+      }
+    } else {
+      if (bit <= 4) {
+        LPC_GPIO2->FIOCLR = (1UL << led_pos2[bit]);
+      } else {
+        LPC_GPIO1->FIOCLR = (1UL << led_pos1[bit - 5]);
+      }
+    }
+  }
+  ledCount++;
+}
 
+void ledTimerInit(void) {
   // set direction for leds to output
   LPC_GPIO1->FIODIR |= (1UL << led_pos1[0]) | (1UL << led_pos1[1]) | (1UL << led_pos1[2]);
   LPC_GPIO2->FIODIR |=
@@ -55,39 +55,24 @@ void ledTimerTask(void *args) {
   LPC_GPIO2->FIOCLR =
       (1UL << led_pos2[0]) | (1UL << led_pos2[1]) | (1UL << led_pos2[2]) | (1UL << led_pos2[3]) | (1UL << led_pos2[4]);
 
-  // tell GLCD we are ready
-  rtosWaitOnSemaphore(&draw_sem);
-  rtosSignalSemaphore(&draw_sem);
-  rtosAcquireMutex(&draw_mutex);
-  rtosEnterCriticalSection();
-  GLCD_DisplayString(2 + readyOrder++, 0, 1, taskName);
-  rtosExitCriticalSection();
-  rtosReleaseMutex(&draw_mutex);
+  ledCount = 0;
+  rtosTimerInit(&ledTimer, ledTimerCallback, NULL);
+}
 
-  // wait until all other tasks are ready to go
-  syncOnBarrier(&barrier);
-  uint32_t timer = 0;
-  while (1) {
-    // write count to leds, going through each bit
-    for (uint8_t bit = 0; bit < 8; bit++) {
-      if (timer & (1 << bit)) {
-        if (bit <= 4) {
-          LPC_GPIO2->FIOSET = (1UL << led_pos2[bit]);
-        } else {
-          LPC_GPIO1->FIOSET = (1UL << led_pos1[bit - 5]);
-        }
-      } else {
-        if (bit <= 4) {
-          LPC_GPIO2->FIOCLR = (1UL << led_pos2[bit]);
-        } else {
-          LPC_GPIO1->FIOCLR = (1UL << led_pos1[bit - 5]);
-        }
-      }
-    }
-    // wait for a second
-    rtosWait(1000);
-    timer++;
-  }
+// print a line to the console without another log line getting in the middle
+void logLine(const char *line) {
+  rtosAcquireMutex(&log_mutex);
+  printf("%s\n", line);
+  rtosReleaseMutex(&log_mutex);
+}
+
+// print a banner for a task, logLine takes the mutex again while we already hold it
+void logBanner(const char *name) {
+  rtosAcquireMutex(&log_mutex);
+  logLine("----------------");
+  printf("%s started\n", name);
+  logLine("----------------");
+  rtosReleaseMutex(&log_mutex);
 }
 
 // task takes in a name, and prints a message to the console,
@@ -98,6 +83,7 @@ void printTask(void *args) {
   unsigned char taskName[21];
 
   sprintf(taskName, "printTask for %s", name);
+  logBanner((char *)taskName);
 
   // we are ready to draw
   rtosWaitOnSemaphore(&draw_sem);
@@ -113,7 +99,7 @@ void printTask(void *args) {
   rtosReleaseMutex(&draw_mutex);
 
   // wait until all other tasks are ready to go
-  syncOnBarrier(&barrier);
+  rtosSyncOnBarrier(&barrier);
   while (1) {
     // aquire the mutex
     rtosAcquireMutex(&print_mutex);
@@ -158,7 +144,7 @@ void lazyGLCDTask(void *args) {
   rtosReleaseMutex(&draw_mutex);
 
   // wait until all other tasks are ready to go
-  syncOnBarrier(&barrier);
+  rtosSyncOnBarrier(&barrier);
 
   // say every thing is done
   unsigned char doneMessage[] = "All Synced :)";
@@ -168,6 +154,9 @@ void lazyGLCDTask(void *args) {
   GLCD_DisplayString(7, 0, 1, doneMessage);
   rtosExitCriticalSection();
   rtosReleaseMutex(&draw_mutex);
+
+  // start the led clock, ticking every second
+  rtosTimerStart(&ledTimer, 1000, 1000);
   while (1){
   }
 }
@@ -193,20 +182,20 @@ int main(void) {
   rtosMutexInit(&draw_mutex);
   rtosSemaphoreInit(&draw_sem, 0);
   readyOrder = 0;
+  // initialize recursive logging mutex
+  rtosRecursiveMutexInit(&log_mutex);
 
-  // initialize barrier type
-  rtosMutexInit(&(barrier.mutex));
-  rtosSemaphoreInit(&(barrier.turnstile), 0);
-  barrier.count = 0;
-  barrier.n = 4;
+  // initialize barrier for all the test tasks
+  rtosBarrierInit(&barrier, testTaskCount);
 
   // start sneaky task
   rtosThreadNew(sneakyTask, NULL, LOWEST_PRIORITY);
 
   // wait on sneaky semaphore before starting remaining tasks
   rtosWaitOnSemaphore(&sneakySem);
-  // start timer task
-  rtosThreadNew(ledTimerTask, NULL, DEFAULT_PRIORITY);
+  // start timer service, so callbacks are not held up by the test tasks
+  rtosTimerServiceInit(HIGHEST_PRIORITY);
+  ledTimerInit();
 
   // start both print tasks
   rtosThreadNew(printTask, (void *)name1, DEFAULT_PRIORITY);
@@ -0,0 +1,310 @@
+/*
+ * Two-level segregated fit (TLSF) allocator, and the system heap built on it
+ */
+#include <LPC17xx.h>
+#include "RTOS.h"
+#include "tlsf.h"
+#include <stdlib.h>
+#include <string.h>
+
+// set in the size field of free blocks, sizes are always a multiple of BLOCK_ALIGN
+#define BLOCK_FREE 0x1
+// malloc has to suit any type, and the AAPCS aligns double and long long to 8
+#define BLOCK_ALIGN 8
+#define BLOCK_ROUND(x) (((x) + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1))
+// prevPhys and size, the free list pointers overlap the payload. Rounded so payloads stay aligned
+#define BLOCK_HEADER_SIZE BLOCK_ROUND(offsetof(tlsfBlock_t, nextFree))
+// a free block has to fit the free list pointers
+#define BLOCK_MIN_SIZE BLOCK_ROUND(sizeof(tlsfBlock_t) - BLOCK_HEADER_SIZE)
+#define BLOCK_MAX_SIZE (1UL << TLSF_FL_MAX)
+
+// size of the system heap behind malloc
+#ifndef HEAP_SIZE
+#define HEAP_SIZE 0x1000
+#endif
+
+__align(8) uint8_t heapMemory[HEAP_SIZE];
+tlsf_t heap;
+mutex_t heapMutex;
+uint8_t heapReady = 0;
+
+uint32_t tlsfBlockSize(tlsfBlock_t *block) { return block->size & ~BLOCK_FREE; }
+
+void *tlsfBlockToPtr(tlsfBlock_t *block) { return (uint8_t *)block + BLOCK_HEADER_SIZE; }
+
+tlsfBlock_t *tlsfPtrToBlock(void *ptr) { return (tlsfBlock_t *)((uint8_t *)ptr - BLOCK_HEADER_SIZE); }
+
+tlsfBlock_t *tlsfNextPhys(tlsfBlock_t *block) {
+  return (tlsfBlock_t *)((uint8_t *)tlsfBlockToPtr(block) + tlsfBlockSize(block));
+}
+
+// x must not be 0 for either of these
+uint8_t tlsfFindLastSet(uint32_t x) { return 31 - __CLZ(x); }
+uint8_t tlsfFindFirstSet(uint32_t x) { return 31 - __CLZ(x & (~x + 1)); }
+
+// list a block of this size is kept in
+void tlsfMappingInsert(uint32_t size, uint8_t *fl, uint8_t *sl) {
+  if (size < TLSF_SMALL_BLOCK) {
+    *fl = 0;
+    *sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+  } else {
+    uint8_t lastSet = tlsfFindLastSet(size);
+    *sl = (size >> (lastSet - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    *fl = lastSet - (TLSF_FL_SHIFT - 1);
+  }
+}
+
+// first list where every block is at least this size
+void tlsfMappingSearch(uint32_t size, uint8_t *fl, uint8_t *sl) {
+  if (size >= TLSF_SMALL_BLOCK) {
+    size += (1UL << (tlsfFindLastSet(size) - TLSF_SL_LOG2)) - 1;
+  }
+  tlsfMappingInsert(size, fl, sl);
+}
+
+void tlsfInsertFreeBlock(tlsf_t *tlsf, tlsfBlock_t *block) {
+  uint8_t fl, sl;
+  tlsfMappingInsert(tlsfBlockSize(block), &fl, &sl);
+
+  block->prevFree = NULL;
+  block->nextFree = tlsf->freeBlocks[fl][sl];
+  if (block->nextFree != NULL) {
+    block->nextFree->prevFree = block;
+  }
+  tlsf->freeBlocks[fl][sl] = block;
+  tlsf->flBitmap |= (1UL << fl);
+  tlsf->slBitmap[fl] |= (1UL << sl);
+}
+
+void tlsfRemoveFreeBlock(tlsf_t *tlsf, tlsfBlock_t *block) {
+  uint8_t fl, sl;
+  tlsfMappingInsert(tlsfBlockSize(block), &fl, &sl);
+
+  if (block->nextFree != NULL) {
+    block->nextFree->prevFree = block->prevFree;
+  }
+  if (block->prevFree != NULL) {
+    block->prevFree->nextFree = block->nextFree;
+  } else {
+    // block was the head of its list, clear the bitmaps if it is now empty
+    tlsf->freeBlocks[fl][sl] = block->nextFree;
+    if (block->nextFree == NULL) {
+      tlsf->slBitmap[fl] &= ~(1UL << sl);
+      if (tlsf->slBitmap[fl] == 0) {
+        tlsf->flBitmap &= ~(1UL << fl);
+      }
+    }
+  }
+}
+
+tlsfBlock_t *tlsfFindSuitableBlock(tlsf_t *tlsf, uint8_t fl, uint8_t sl) {
+  // look for a big enough list in the same first level, then in any larger one
+  uint32_t slMap = tlsf->slBitmap[fl] & (~0U << sl);
+  if (slMap == 0) {
+    uint32_t flMap = tlsf->flBitmap & (~0U << (fl + 1));
+    if (flMap == 0) {
+      return NULL;
+    }
+    fl = tlsfFindFirstSet(flMap);
+    slMap = tlsf->slBitmap[fl];
+  }
+  sl = tlsfFindFirstSet(slMap);
+  return tlsf->freeBlocks[fl][sl];
+}
+
+void tlsfInit(tlsf_t *tlsf, void *memory, uint32_t size) {
+  memset(tlsf, 0, sizeof(tlsf_t));
+
+  // align the start, and keep room for the sentinel at the end
+  uint32_t start = ((uint32_t)memory + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+  size = (size - (start - (uint32_t)memory)) & ~(BLOCK_ALIGN - 1);
+  if (size < 2 * BLOCK_HEADER_SIZE + BLOCK_MIN_SIZE) {
+    // too small to hold anything
+    return;
+  }
+  uint32_t blockSize = size - 2 * BLOCK_HEADER_SIZE;
+  if (blockSize >= BLOCK_MAX_SIZE) {
+    blockSize = BLOCK_MAX_SIZE - BLOCK_ALIGN;
+  }
+
+  // one free block spanning everything
+  tlsfBlock_t *block = (tlsfBlock_t *)start;
+  block->prevPhys = NULL;
+  block->size = blockSize | BLOCK_FREE;
+  tlsfInsertFreeBlock(tlsf, block);
+
+  // a used, empty block after it so merging never runs off the end
+  tlsfBlock_t *sentinel = tlsfNextPhys(block);
+  sentinel->prevPhys = block;
+  sentinel->size = 0;
+
+  tlsf->totalSize = blockSize + BLOCK_HEADER_SIZE;
+}
+
+void *tlsfMalloc(tlsf_t *tlsf, uint32_t size) {
+  if (size == 0 || size >= BLOCK_MAX_SIZE) {
+    return NULL;
+  }
+  size = (size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+  if (size < BLOCK_MIN_SIZE) {
+    size = BLOCK_MIN_SIZE;
+  }
+
+  uint8_t fl, sl;
+  tlsfMappingSearch(size, &fl, &sl);
+  if (fl >= TLSF_FL_COUNT) {
+    return NULL;
+  }
+  tlsfBlock_t *block = tlsfFindSuitableBlock(tlsf, fl, sl);
+  if (block == NULL) {
+    return NULL;
+  }
+  tlsfRemoveFreeBlock(tlsf, block);
+
+  // split off the rest if it is big enough to be a block of its own
+  if (tlsfBlockSize(block) >= size + BLOCK_HEADER_SIZE + BLOCK_MIN_SIZE) {
+    tlsfBlock_t *remaining = (tlsfBlock_t *)((uint8_t *)tlsfBlockToPtr(block) + size);
+    remaining->prevPhys = block;
+    remaining->size = (tlsfBlockSize(block) - size - BLOCK_HEADER_SIZE) | BLOCK_FREE;
+    tlsfNextPhys(remaining)->prevPhys = remaining;
+    block->size = size;
+    tlsfInsertFreeBlock(tlsf, remaining);
+  }
+  block->size &= ~BLOCK_FREE;
+
+  tlsf->usedSize += tlsfBlockSize(block) + BLOCK_HEADER_SIZE;
+  if (tlsf->usedSize > tlsf->peakUsedSize) {
+    tlsf->peakUsedSize = tlsf->usedSize;
+  }
+  return tlsfBlockToPtr(block);
+}
+
+void tlsfFree(tlsf_t *tlsf, void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  tlsfBlock_t *block = tlsfPtrToBlock(ptr);
+  tlsf->usedSize -= tlsfBlockSize(block) + BLOCK_HEADER_SIZE;
+  block->size |= BLOCK_FREE;
+
+  // merge with the previous block if it is free
+  tlsfBlock_t *prev = block->prevPhys;
+  if (prev != NULL && (prev->size & BLOCK_FREE)) {
+    tlsfRemoveFreeBlock(tlsf, prev);
+    prev->size += tlsfBlockSize(block) + BLOCK_HEADER_SIZE;
+    block = prev;
+    tlsfNextPhys(block)->prevPhys = block;
+  }
+
+  // merge with the next block if it is free, the sentinel never is
+  tlsfBlock_t *next = tlsfNextPhys(block);
+  if (next->size & BLOCK_FREE) {
+    tlsfRemoveFreeBlock(tlsf, next);
+    block->size += tlsfBlockSize(next) + BLOCK_HEADER_SIZE;
+    tlsfNextPhys(block)->prevPhys = block;
+  }
+
+  tlsfInsertFreeBlock(tlsf, block);
+}
+
+void *tlsfRealloc(tlsf_t *tlsf, void *ptr, uint32_t size) {
+  if (ptr == NULL) {
+    return tlsfMalloc(tlsf, size);
+  }
+  if (size == 0) {
+    tlsfFree(tlsf, ptr);
+    return NULL;
+  }
+
+  uint32_t oldSize = tlsfBlockSize(tlsfPtrToBlock(ptr));
+  if (oldSize >= size) {
+    // already big enough
+    return ptr;
+  }
+  void *newPtr = tlsfMalloc(tlsf, size);
+  if (newPtr != NULL) {
+    memcpy(newPtr, ptr, oldSize);
+    tlsfFree(tlsf, ptr);
+  }
+  return newPtr;
+}
+
+void tlsfGetStats(tlsf_t *tlsf, tlsfStats_t *stats) {
+  stats->totalSize = tlsf->totalSize;
+  stats->usedSize = tlsf->usedSize;
+  stats->peakUsedSize = tlsf->peakUsedSize;
+  stats->freeSize = tlsf->totalSize - tlsf->usedSize;
+
+  // the largest block is in the highest non-empty list, but that list is not sorted
+  stats->largestFreeBlock = 0;
+  if (tlsf->flBitmap != 0) {
+    uint8_t fl = tlsfFindLastSet(tlsf->flBitmap);
+    uint8_t sl = tlsfFindLastSet(tlsf->slBitmap[fl]);
+    for (tlsfBlock_t *block = tlsf->freeBlocks[fl][sl]; block != NULL; block = block->nextFree) {
+      if (tlsfBlockSize(block) > stats->largestFreeBlock) {
+        stats->largestFreeBlock = tlsfBlockSize(block);
+      }
+    }
+  }
+
+  stats->fragmentation = 0;
+  if (stats->freeSize != 0) {
+    stats->fragmentation = 100 - ((stats->largestFreeBlock + BLOCK_HEADER_SIZE) * 100) / stats->freeSize;
+  }
+}
+
+void heapLock(void) {
+  if (!heapReady) {
+    // set up on first use, so it works before main and before rtosInit
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!heapReady) {
+      rtosMutexInit(&heapMutex);
+      tlsfInit(&heap, heapMemory, HEAP_SIZE);
+      heapReady = 1;
+    }
+    __set_PRIMASK(primask);
+  }
+  // does nothing until rtosInit, when there is only one thread anyway
+  rtosAcquireMutex(&heapMutex);
+}
+
+void heapUnlock(void) { rtosReleaseMutex(&heapMutex); }
+
+void heapGetStats(tlsfStats_t *stats) {
+  heapLock();
+  tlsfGetStats(&heap, stats);
+  heapUnlock();
+}
+
+// replace the C library heap, none of these may be called from an interrupt
+void *malloc(size_t size) {
+  heapLock();
+  void *ptr = tlsfMalloc(&heap, size);
+  heapUnlock();
+  return ptr;
+}
+
+void free(void *ptr) {
+  heapLock();
+  tlsfFree(&heap, ptr);
+  heapUnlock();
+}
+
+void *realloc(void *ptr, size_t size) {
+  heapLock();
+  void *newPtr = tlsfRealloc(&heap, ptr, size);
+  heapUnlock();
+  return newPtr;
+}
+
+void *calloc(size_t count, size_t size) {
+  if (size != 0 && count > BLOCK_MAX_SIZE / size) {
+    return NULL;
+  }
+  void *ptr = malloc(count * size);
+  if (ptr != NULL) {
+    memset(ptr, 0, count * size);
+  }
+  return ptr;
+}
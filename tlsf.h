@@ -0,0 +1,58 @@
+/*
+ * Two-level segregated fit (TLSF) allocator, O(1) malloc and free
+ */
+#ifndef __TLSF_H
+#define __TLSF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// second level lists per power of two, as a power of two
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+// sizes below this all go in first level list 0, split evenly over its second level lists
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 2)
+#define TLSF_SMALL_BLOCK (1 << TLSF_FL_SHIFT)
+// blocks are always smaller than 2^TLSF_FL_MAX bytes
+#define TLSF_FL_MAX 16
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+typedef struct tlsfBlock tlsfBlock_t;
+
+struct tlsfBlock {
+  tlsfBlock_t *prevPhys;
+  uint32_t size;
+  // only valid while the block is free, they share space with the payload
+  tlsfBlock_t *nextFree;
+  tlsfBlock_t *prevFree;
+};
+
+typedef struct {
+  uint32_t flBitmap;
+  uint32_t slBitmap[TLSF_FL_COUNT];
+  tlsfBlock_t *freeBlocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+  uint32_t totalSize;
+  uint32_t usedSize;
+  uint32_t peakUsedSize;
+} tlsf_t;
+
+typedef struct {
+  uint32_t totalSize;
+  uint32_t usedSize;
+  uint32_t peakUsedSize;
+  uint32_t freeSize;
+  uint32_t largestFreeBlock;
+  // percentage of free memory that is not in the largest free block
+  uint8_t fragmentation;
+} tlsfStats_t;
+
+void tlsfInit(tlsf_t *tlsf, void *memory, uint32_t size);
+void *tlsfMalloc(tlsf_t *tlsf, uint32_t size);
+void tlsfFree(tlsf_t *tlsf, void *ptr);
+void *tlsfRealloc(tlsf_t *tlsf, void *ptr, uint32_t size);
+void tlsfGetStats(tlsf_t *tlsf, tlsfStats_t *stats);
+
+// system heap behind malloc, locked with an RTOS mutex once the RTOS is running
+void heapGetStats(tlsfStats_t *stats);
+
+#endif /* __TLSF_H */
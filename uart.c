@@ -28,17 +28,21 @@ volatile int ITM_RxBuffer = ITM_RXBUFFER_EMPTY; /*  CMSIS Debug Input        */
 
 volatile uint32_t UART0Status, UART1Status;
 volatile uint8_t UART0TxEmpty = 1, UART1TxEmpty = 1;
-volatile uint8_t UART0Buffer[BUFSIZE], UART1Buffer[BUFSIZE];
-volatile uint32_t UART0Count = 0, UART1Count = 0;
+uint8_t UART0Buffer[BUFSIZE], UART1Buffer[BUFSIZE];
+// received bytes, the UART service is the only producer and UARTRecieve the only consumer
+ringBuffer_t UART0Ring, UART1Ring;
+// keeps UARTRecieve callers to one at a time per port, and lets them block instead of spinning
+mutex_t UART0RcvMutex, UART1RcvMutex;
 
-volatile uint8_t RcvLock0;
 volatile uint8_t SndLock0;
-
-volatile uint8_t RcvLock1;
 volatile uint8_t SndLock1;
 
 volatile int i = 0;
 
+// when set, the UART interrupts are serviced by a worker instead of in the ISR
+workQueue_t *UARTWorkQueue = NULL;
+workItem_t UART0Work, UART1Work;
+
 void Free(volatile uint8_t *tbl) { *tbl = 0; }
 
 uint8_t Lock(volatile uint8_t *tbl) {
@@ -51,24 +55,12 @@ uint8_t Lock(volatile uint8_t *tbl) {
   }
 }
 
-uint8_t LockRcv(uint8_t portNum) {
-  if (portNum > 1)
-    return 0x1;
-  return Lock(portNum == 0 ? &RcvLock0 : &RcvLock1);
-}
-
 uint8_t LockSnd(uint8_t portNum) {
   if (portNum > 1)
     return 0x1;
   return Lock(portNum == 0 ? &SndLock0 : &SndLock1);
 }
 
-void FreeRcv(uint8_t portNum) {
-  if (portNum > 1)
-    return;
-  Free(portNum == 0 ? &RcvLock0 : &RcvLock1);
-}
-
 void FreeSnd(uint8_t portNum) {
   if (portNum > 1)
     return;
@@ -76,15 +68,16 @@ void FreeSnd(uint8_t portNum) {
 }
 
 /*****************************************************************************
-** Function name:		UART0_IRQHandler
+** Function name:		UART0Service
 **
-** Descriptions:		UART0 interrupt handler
+** Descriptions:		UART0 interrupt processing, run from the ISR or
+**						from a work queue worker
 **
 ** parameters:			None
 ** Returned value:		None
 **
 *****************************************************************************/
-void UART0_IRQHandler(void) {
+void UART0Service(void) {
   uint8_t IIRValue, LSRValue;
 
   IIRValue = LPC_UART0->IIR;
@@ -96,12 +89,10 @@ void UART0_IRQHandler(void) {
 
   if (LSRValue & LSR_RDR) /* Receive Data Ready */
   {
-    /* If no error on RLS, normal ready, save into the data buffer. */
-    /* Note: read RBR will clear the interrupt */
-    UART0Buffer[UART0Count] = LPC_UART0->RBR;
-    UART0Count++;
-    if (UART0Count == BUFSIZE) {
-      UART0Count = 0; /* buffer overflow */
+    /* If no error on RLS, normal ready, drain the FIFO into the ring. */
+    /* Note: read RBR will clear the interrupt, bytes that don't fit are dropped */
+    while (LPC_UART0->LSR & LSR_RDR) {
+      rtosRingBufferPut(&UART0Ring, LPC_UART0->RBR);
     }
   }
 
@@ -119,15 +110,16 @@ void UART0_IRQHandler(void) {
 }
 
 /*****************************************************************************
-** Function name:		UART1_IRQHandler
+** Function name:		UART1Service
 **
-** Descriptions:		UART1 interrupt handler
+** Descriptions:		UART1 interrupt processing, run from the ISR or
+**						from a work queue worker
 **
 ** parameters:			None
 ** Returned value:		None
 **
 *****************************************************************************/
-void UART1_IRQHandler(void) {
+void UART1Service(void) {
 
   uint8_t IIRValue, LSRValue;
 
@@ -140,12 +132,10 @@ void UART1_IRQHandler(void) {
 
   if (LSRValue & LSR_RDR) /* Receive Data Ready */
   {
-    /* If no error on RLS, normal ready, save into the data buffer. */
-    /* Note: read RBR will clear the interrupt */
-    UART1Buffer[UART1Count] = LPC_UART1->RBR;
-    UART1Count++;
-    if (UART1Count == BUFSIZE) {
-      UART0Count = 0; /* buffer overflow */
+    /* If no error on RLS, normal ready, drain the FIFO into the ring. */
+    /* Note: read RBR will clear the interrupt, bytes that don't fit are dropped */
+    while (LPC_UART1->LSR & LSR_RDR) {
+      rtosRingBufferPut(&UART1Ring, LPC_UART1->RBR);
     }
   }
 
@@ -162,6 +152,84 @@ void UART1_IRQHandler(void) {
   }
 }
 
+void UART0WorkFunc(workItem_t *item) {
+  UART0Service();
+  // the line was masked when the work was submitted, anything that came in since pends again now
+  NVIC_EnableIRQ(UART0_IRQn);
+}
+
+void UART1WorkFunc(workItem_t *item) {
+  UART1Service();
+  NVIC_EnableIRQ(UART1_IRQn);
+}
+
+/*****************************************************************************
+** Function name:		UART0_IRQHandler
+**
+** Descriptions:		UART0 interrupt handler, hands the work to the
+**						UART work queue if there is one
+**
+** parameters:			None
+** Returned value:		None
+**
+*****************************************************************************/
+void UART0_IRQHandler(void) {
+  if (UARTWorkQueue != NULL) {
+    // mask the line until the worker has serviced the UART, it stays pending until then
+    NVIC_DisableIRQ(UART0_IRQn);
+    if (rtosSubmitWorkFromISR(UARTWorkQueue, &UART0Work) == RTOS_OK) {
+      return;
+    }
+    NVIC_EnableIRQ(UART0_IRQn);
+  }
+  UART0Service();
+}
+
+/*****************************************************************************
+** Function name:		UART1_IRQHandler
+**
+** Descriptions:		UART1 interrupt handler, hands the work to the
+**						UART work queue if there is one
+**
+** parameters:			None
+** Returned value:		None
+**
+*****************************************************************************/
+void UART1_IRQHandler(void) {
+  if (UARTWorkQueue != NULL) {
+    NVIC_DisableIRQ(UART1_IRQn);
+    if (rtosSubmitWorkFromISR(UARTWorkQueue, &UART1Work) == RTOS_OK) {
+      return;
+    }
+    NVIC_EnableIRQ(UART1_IRQn);
+  }
+  UART1Service();
+}
+
+/*****************************************************************************
+** Function name:		UARTSetWorkQueue
+**
+** Descriptions:		Move UART interrupt processing out of the ISRs
+**						and into the workers of a work queue
+**
+** parameters:			work queue, or NULL to process in the ISRs again
+** Returned value:		true or false, return false if work is still
+**						pending on the old queue
+**
+*****************************************************************************/
+uint32_t UARTSetWorkQueue(workQueue_t *queue) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  if (UART0Work.pending || UART1Work.pending) {
+    // the item is still linked into the old queue, its worker has to take it first
+    __set_PRIMASK(primask);
+    return (FALSE);
+  }
+  UARTWorkQueue = queue;
+  __set_PRIMASK(primask);
+  return (TRUE);
+}
+
 /* By default, the PCLKSELx value is zero, thus, the PCLK for
         all the peripherals is 1/4 of the SystemFrequency. */
 uint32_t getFrequency(uint32_t clk_slct) {
@@ -219,12 +287,16 @@ uint32_t UARTInit(uint32_t PortNum, uint32_t baudrate) {
     LPC_UART0->LCR = 0x03; /* DLAB = 0 */
     LPC_UART0->FCR = 0x07; /* Enable and reset TX and RX FIFO. */
 
+    rtosRingBufferInit(&UART0Ring, UART0Buffer, BUFSIZE);
+    rtosMutexInit(&UART0RcvMutex);
+    // set up before the line is unmasked, the ISR may submit it from then on
+    rtosWorkItemInit(&UART0Work, UART0WorkFunc, NULL, HIGHEST_PRIORITY);
+
     NVIC_EnableIRQ(UART0_IRQn);
 
     // LPC_UART0->IER = IER_RBR | IER_THRE | IER_RLS;	/* Enable UART0 interrupt */
     // LPC_UART0->IER =  IER_THRE ;//| IER_RLS;			/* Disable RBR */
 
-    FreeRcv(0);
     FreeSnd(0);
     return (TRUE);
   } else if (PortNum == 1) {
@@ -245,11 +317,14 @@ uint32_t UARTInit(uint32_t PortNum, uint32_t baudrate) {
     LPC_UART1->LCR = 0x03; /* DLAB = 0 */
     LPC_UART1->FCR = 0x07; /* Enable and reset TX and RX FIFO. */
 
+    rtosRingBufferInit(&UART1Ring, UART1Buffer, BUFSIZE);
+    rtosMutexInit(&UART1RcvMutex);
+    rtosWorkItemInit(&UART1Work, UART1WorkFunc, NULL, HIGHEST_PRIORITY);
+
     NVIC_EnableIRQ(UART1_IRQn);
 
     // LPC_UART1->IER = IER_RBR | IER_THRE | IER_RLS;	/* Enable UART1 interrupt */
 
-    FreeRcv(1);
     FreeSnd(1);
 
     return (TRUE);
@@ -331,43 +406,35 @@ void UARTSendChar(uint32_t portNum, uint8_t character) {
 uint32_t UARTRecieve(uint32_t portNum, uint8_t *BufferPtr, uint32_t Length) {
 
   LPC_UART_TypeDef *LPC_UART;
-  volatile uint32_t *UARTCount; // ASK Douglas
-  volatile uint8_t *UARTBuffer;
-  uint8_t *rcvdBufferPtr;
-  uint32_t rcvd_len, i;
+  ringBuffer_t *UARTRing;
+  mutex_t *UARTRcvMutex;
+  uint32_t rcvd_len;
 
-  if ((portNum >> 1) != 0)
+  if ((portNum >> 1) != 0 || Length == 0)
     return 0;
 
   rcvd_len = 0x0;
-  rcvdBufferPtr = BufferPtr;
-  UARTCount = (portNum == 0 ? &UART0Count : &UART1Count);
-  UARTBuffer = (portNum == 0 ? UART0Buffer : UART1Buffer);
+  UARTRing = (portNum == 0 ? &UART0Ring : &UART1Ring);
+  UARTRcvMutex = (portNum == 0 ? &UART0RcvMutex : &UART1RcvMutex);
   LPC_UART = (portNum == 0 ? (LPC_UART_TypeDef *)LPC_UART0 : (LPC_UART_TypeDef *)LPC_UART1);
 
-  *UARTCount = 0x0;
+  // the ring has a single consumer, a blocking mutex so the holder can sleep on the ring while others wait
+  // before the rtos is running there is only one caller, and acquiring just returns RTOS_NOT_INIT
+  rtosAcquireMutex(UARTRcvMutex);
 
-  // Enable interupt
+  // Enable interupt, it stays on so bytes keep streaming into the ring between calls
   LPC_UART->IER |= IER_RBR;
 
-  // busy waiting
-
-  while (*UARTCount == 0)
-    ;
-
-  // This part has to be put in the critical section
-  while (LockRcv(portNum))
+  // sleep until the first byte, busy waiting if the rtos isn't running yet
+  while (rtosRingBufferGet(UARTRing, &BufferPtr[0], 1) != RTOS_OK)
     ;
+  rcvd_len++;
 
-  // Reanble other interpts
-  LPC_UART->IER &= ~IER_RBR; /* Disable RBR */
-
-  for (i = 0; i < *UARTCount; ++i)
-    rcvdBufferPtr[rcvd_len++] = UARTBuffer[i];
-
-  *UARTCount = 0;
+  // then take whatever else is already there
+  while (rcvd_len < Length && rtosRingBufferGet(UARTRing, &BufferPtr[rcvd_len], 0) == RTOS_OK)
+    rcvd_len++;
 
-  FreeRcv(portNum);
+  rtosReleaseMutex(UARTRcvMutex);
 
   return rcvd_len;
 }
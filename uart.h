@@ -21,6 +21,7 @@
 #define __UART_H
 
 #include <stdint.h>
+#include "RTOS.h"
 
 #define IER_RBR 0x01
 #define IER_THRE 0x02
@@ -53,6 +54,9 @@
 
 void UART0_IRQHandler(void);
 void UART1_IRQHandler(void);
+void UART0Service(void);
+void UART1Service(void);
+uint32_t UARTSetWorkQueue(workQueue_t *queue);
 
 uint32_t UARTInit(uint32_t portNum, uint32_t Baudrate);
 